@@ -19,6 +19,8 @@
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -30,13 +32,18 @@
 #include "common/conventions.h"
 #include "common/mmapread.h"
 #include "common/mapmem.h"
+#include "common/fileio.h"
 #include "options.h"
 #include "scan.h"
 #include "range.h"
+#include "compress.h"
 #include "mkfs.h"
+#include "store.h"
 
 #include "assemble.h"
 
+#define SIZE_METABLOCK_ASSEMBLE	8192
+
 
 void voidinit_assemble(struct assemble *a, struct scan *s, struct temp_sqfs_mkfs *m, struct range *r, unsigned int log_blocksize) {
 if (log_blocksize<12) log_blocksize=17;
@@ -48,15 +55,187 @@ a->blocksize=(1<<log_blocksize);
 a->log_blocksize=log_blocksize;
 }
 
+int setfragments_assemble(struct assemble *a, struct config_compress *compress) {
+// call after voidinit_assemble, compress->level==0 => fragment blocks aren't compressed
+a->fragments.isenabled=1;
+if (init_compress(&a->fragments.compressor,compress)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+void deinit_assemble(struct assemble *a) {
+(void)deinit_compress(&a->fragments.compressor);
+}
+
+void setexporttable_assemble(struct assemble *a) {
+// call after voidinit_assemble
+a->isexporttable=1;
+}
+
+static int flushfragment(struct assemble *a) {
+// adds the current fragment block to range and the fragment table
+unsigned char *data;
+unsigned int len;
+uint32_t size;
+
+if (!a->fragments.fill) return 0;
+len=a->fragments.fill;
+size=len|(1<<24); // 16777216 is uncompressed bit
+data=a->fragments.block;
+if (a->fragments.compressor.isinit) {
+	unsigned int destlen;
+	if (block_compress(&destlen,&a->fragments.compressor,a->fragments.spare,len-1,a->fragments.block,len)) GOTOERROR;
+	if (destlen) {
+		a->mkfs->stats.bytessaved+=len-destlen;
+		a->mkfs->stats.compressedfragments+=1;
+		len=destlen;
+		size=len;
+		data=a->fragments.spare;
+	}
+}
+{
+	unsigned char *copy;
+	if (!(copy=alloc_name_range(a->range,len))) GOTOERROR;
+	memcpy(copy,data,len);
+	if (add_fragment_mkfs(a->mkfs,a->range->entries.nextstart-a->archivebase,size)) GOTOERROR;
+	if (add_internal_range(a->range,copy,len)) GOTOERROR;
+}
+a->fragments.fill=0;
+return 0;
+error:
+	return -1;
+}
+
+static int addfragment(struct assemble *a, int *dirfd_inout, struct directory_range *rd, struct dirent_scan *de,
+		struct file_scan *fs, unsigned int tail) {
+// packs the last tail bytes of de's file into the fragment block, fs is de's file or its duplicate
+unsigned char *dest;
+unsigned int got;
+int fd=-1;
+
+if (!a->fragments.block) {
+	if (!(a->fragments.block=alloc_mapmem(a->mkfs->mm,a->blocksize))) GOTOERROR;
+	if (a->fragments.compressor.isinit) {
+		if (!(a->fragments.spare=alloc_mapmem(a->mkfs->mm,a->blocksize))) GOTOERROR;
+	}
+}
+if (a->fragments.fill+tail>a->blocksize) {
+	if (flushfragment(a)) GOTOERROR;
+}
+
+if (de->overlay) {
+	if (0>(fd=open(de->overlay,O_RDONLY))) {
+		syslog(LOG_ERR,"Error opening file: %s %s",de->overlay,strerror(errno));
+		GOTOERROR;
+	}
+} else {
+	if (*dirfd_inout<0) {
+		if (!rd) GOTOERROR;
+		if (opendirectory_range(dirfd_inout,a->range,rd)) GOTOERROR;
+	}
+	if (0>(fd=openat(*dirfd_inout,de->filename,O_RDONLY))) {
+		syslog(LOG_ERR,"Error opening file: %s %s",de->filename,strerror(errno));
+		GOTOERROR;
+	}
+}
+dest=a->fragments.block+a->fragments.fill;
+if (preadn(fd,dest,tail,fs->size-tail,&got)) GOTOERROR;
+if (got<tail) memset(dest+got,0,tail-got); // file shrank, range zero-fills these too
+(ignore)close(fd);
+
+fs->isfragment=1;
+fs->fragindex=a->mkfs->fragmentlist.count;
+fs->fragoffset=a->fragments.fill;
+a->fragments.fill+=tail;
+a->fragments.files+=1;
+return 0;
+error:
+	ignore_ifclose(fd);
+	return -1;
+}
+
+static int addblocks(struct assemble *a, struct directory_range *rd, struct dirent_scan *de, struct file_scan *fs,
+		uint64_t blockbytes) {
+// adds the file's data blocks to range, holes in sparse files are left out
+struct directory_range *directory=rd;
+char *filename;
+uint64_t offset,runstart=0;
+unsigned int cursor=0;
+
+if (de->overlay) {
+	directory=NULL;
+	if (!(filename=dupname_range(a->range,de->overlay,strlen(de->overlay)))) GOTOERROR;
+} else {
+#ifdef DEBUG
+	if (!rd) GOTOERROR;
+#endif
+	if (!(filename=dupname_range(a->range,de->filename,de->filenamelen))) GOTOERROR;
+}
+if (!fs->issparse) return noalloc_add_external_range(a->range,directory,filename,blockbytes);
+
+for (offset=0;offset<blockbytes;offset+=a->blocksize) {
+	uint64_t end;
+	end=offset+a->blocksize;
+	if (end>blockbytes) end=blockbytes;
+	if (!isholeblock_scan(&cursor,fs,offset,end)) continue;
+	// mkfs gives this block a 0 size, it takes no space in the archive
+	if (runstart<offset) {
+		if (noalloc_addpart_external_range(a->range,directory,filename,runstart,offset-runstart)) GOTOERROR;
+	}
+	runstart=end;
+}
+if (runstart<blockbytes) {
+	if (noalloc_addpart_external_range(a->range,directory,filename,runstart,blockbytes-runstart)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int placedata(struct assemble *a, int *dirfd_inout, struct directory_range *rd, struct dirent_scan *de,
+		struct file_scan *fs) {
+// adds fs's data to range, reading it from de's file
+fs->blocksstart=a->range->entries.nextstart;
+fs->isplaced=1;
+if (fs->store && !fs->store->israw) {
+	struct file_store *f=fs->store;
+	if (!f->datasize) {
+		// every block is a hole, there's nothing to add
+	} else if (f->cachefile) {
+		if (noalloc_add_external_range(a->range,NULL,f->cachefile,f->datasize)) GOTOERROR;
+	} else {
+		if (add_internal_range(a->range,f->data,(unsigned int)f->datasize)) GOTOERROR;
+	}
+} else if (fs->size) {
+	uint64_t blockbytes=fs->size;
+	unsigned int tail=0;
+	if (a->fragments.isenabled) {
+		tail=blockbytes&(a->blocksize-1);
+		blockbytes-=tail;
+	}
+	if (blockbytes) { // otherwise it's all in a fragment
+		if (addblocks(a,rd,de,fs,blockbytes)) GOTOERROR;
+	}
+	if (tail) {
+		if (addfragment(a,dirfd_inout,rd,de,fs,tail)) GOTOERROR;
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
 SICLEARFUNC(dirsize_mkfs);
 static int directory_build(struct assemble *a, struct directory_scan *d, struct directory_range *parent,
-		char *dirname, unsigned int dirnamelen, char *overlay) {
+		char *dirname, char *overlay) {
 struct scan *scan=a->scan;
 struct dirent_scan *de;
 struct directory_range *rd;
 struct dirsize_mkfs dirsize,w_dirsize;
-unsigned int blocksoffset_d;
+unsigned int blockindex_d;
 unsigned short offsetinblock_d;
+int dirfd=-1; // for reading fragment tails
 
 clear_dirsize_mkfs(&dirsize);
 clear_dirsize_mkfs(&w_dirsize);
@@ -64,8 +243,8 @@ clear_dirsize_mkfs(&w_dirsize);
 // DEBUGOUT((stderr,"Entering directory i:%u\n",d->common.inodeindex));
 if (!d->isnotzero) rd=NULL; // no need to save directory in range (directory not necessarily empty for fs)
 else if (overlay) {
-	 if (!(rd=add_directory_range(a->range,NULL,overlay,strlen(overlay)))) GOTOERROR;
-} else if (!(rd=add_directory_range(a->range,parent,dirname,dirnamelen))) GOTOERROR;
+	 if (!(rd=add_directory_range(a->range,NULL,overlay))) GOTOERROR;
+} else if (!(rd=add_directory_range(a->range,parent,dirname))) GOTOERROR;
 
 (void)setlinearvars_scan(scan,d); // sets next pointers and inodeindex vals
 
@@ -74,12 +253,12 @@ else if (overlay) {
 for (de=d->entries.first;de;de=de->next) {
 	switch (de->type) {
 		case DIRECTORY_TYPE_SCAN:
-			if (directory_build(a,de->directory,rd,de->filename,de->filenamelen,de->overlay)) GOTOERROR; // build subdirs first
+			if (directory_build(a,de->directory,rd,de->filename,de->overlay)) GOTOERROR; // build subdirs first
 		break;
 	}
 }
 
-blocksoffset_d=a->mkfs->directory_table.blockoffset;
+blockindex_d=a->mkfs->directory_table.blockindex;
 offsetinblock_d=a->mkfs->directory_table.blockfill;
 
 // add inodes, ranges and calculate dirent sizes
@@ -89,17 +268,12 @@ for (de=d->entries.first;de;de=de->next) {
 	switch (de->type) {
 		case FILE_TYPE_SCAN:
 			if (!de->file->common.inode->dataoffset) {
-				de->file->common.inode->dataoffset=a->range->entries.nextstart;
-				if (de->file->size) {
-					if (de->overlay) {
-						if (add_external_range(a->range,NULL,de->overlay,strlen(de->overlay),de->file->size)) GOTOERROR;
-					} else {
-#ifdef DEBUG
-						if (!rd) GOTOERROR;
-#endif
-						if (add_external_range(a->range,rd,de->filename,de->filenamelen,de->file->size)) GOTOERROR;
-					}
+				struct file_scan *fs=de->file;
+				if (fs->dupof) fs=fs->dupof; // identical, either one's path works
+				if (!fs->isplaced) {
+					if (placedata(a,&dirfd,rd,de,fs)) GOTOERROR;
 				}
+				de->file->common.inode->dataoffset=fs->blocksstart;
 				if (add_file_inode_mkfs(a->mkfs,de->file)) GOTOERROR;
 			}
 			(ignore)count_dirsize_mkfs(&dirsize,&de->file->common,de->filenamelen);
@@ -132,6 +306,11 @@ for (de=d->entries.first;de;de=de->next) {
 	}
 }
 (void)finish_dirsize_mkfs(&dirsize);
+if (offsetinblock_d+dirsize.size>SIZE_METABLOCK_ASSEMBLE) { // the listing crosses metablocks, give it an index
+	w_dirsize.maxindex=dirsize.size/SIZE_METABLOCK_ASSEMBLE+2;
+	if (!(w_dirsize.index=alloc_mapmem(a->mkfs->mm,w_dirsize.maxindex*sizeof(struct dirindex_scan)))) GOTOERROR;
+	w_dirsize.indexblock=blockindex_d;
+}
 // now everything is done except dirheads/dirents and we have all the values
 // we'll want to save the offset of the rootdir to the superblock
 for (de=d->entries.first;de;de=de->next) {
@@ -166,10 +345,14 @@ if (w_dirsize.size!=dirsize.size) {
 	GOTOERROR;
 }
 d->tablesize=dirsize.size;
-d->blocksoffset=blocksoffset_d;
+d->blockindex=blockindex_d;
 d->offsetinblock=offsetinblock_d;
+d->index=w_dirsize.index;
+d->indexcount=w_dirsize.indexcount;
+ignore_ifclose(dirfd);
 return 0;
 error:
+	ignore_ifclose(dirfd);
 	return -1;
 }
 
@@ -177,46 +360,85 @@ static int idblocks_build(struct assemble *a, struct id_scan *top) {
 return fixandadd_idblocks_mkfs(a->mkfs,top);
 }
 
+#define setu16(a,b) *(uint16_t*)(a)=htole16(b)
 int build_assemble(struct assemble *a) {
+struct config_compress *compress=&a->mkfs->compress.compressor.config;
 unsigned char *superblock;
 struct superblock_sqfs_mkfs sb;
 uint64_t rootref;
-unsigned int tablesizes,pad4k;
+unsigned int tablesizes,othersizes,pad4k,optionsize=0;
 #ifdef DEBUG
 unsigned int idblockoffset;
 #endif
 uint64_t id_table_start,idblock_table_start,inode_table_start,directory_table_start,archivesize;
+uint64_t fragment_table_start=0xFFFFFFFFFFFFFFFF,fragmentblock_table_start=0;
+uint64_t export_table_start=0xFFFFFFFFFFFFFFFF,exportblock_table_start=0;
 uint64_t archivebase;
 
 if (a->isbuilt) return 0;
 a->isbuilt=1;
 
 archivebase=a->range->entries.nextstart; // usually 0, but inject can push this up
-if (!(superblock=alloc_name_range(a->range,NUM_SUPERBLOCK_SQFS_MKFS))) GOTOERROR;
-if (add_internal_range(a->range,superblock,NUM_SUPERBLOCK_SQFS_MKFS)) GOTOERROR;
+a->archivebase=archivebase;
+{
+	unsigned char options[MAXOPTIONS_COMPRESS];
+	if (compress->level) optionsize=options_compress(options,compress);
+	if (optionsize) optionsize+=2; // compressor options are an uncompressed metablock after the superblock
+	if (!(superblock=alloc_name_range(a->range,NUM_SUPERBLOCK_SQFS_MKFS+optionsize))) GOTOERROR;
+	if (optionsize) {
+		setu16(superblock+NUM_SUPERBLOCK_SQFS_MKFS,(optionsize-2)|0x8000);
+		memcpy(superblock+NUM_SUPERBLOCK_SQFS_MKFS+2,options,optionsize-2);
+	}
+}
+if (add_internal_range(a->range,superblock,NUM_SUPERBLOCK_SQFS_MKFS+optionsize)) GOTOERROR;
 if (idblocks_build(a,a->scan->ids.top)) GOTOERROR;
+if (a->isexporttable) {
+	if (setexport_mkfs(a->mkfs,a->scan->counts.inodes)) GOTOERROR;
+}
 // TODO move rootdir.path into a fake directory_range
-if (directory_build(a,&a->scan->rootdir.directory,NULL,NULL,0,a->scan->rootdir.path)) GOTOERROR;
-rootref=((uint64_t)a->mkfs->inode_table.blockoffset<<16)|a->mkfs->inode_table.blockfill;
+if (directory_build(a,&a->scan->rootdir.directory,NULL,NULL,a->scan->rootdir.path)) GOTOERROR;
+if (flushfragment(a)) GOTOERROR;
+(void)deinit_compress(&a->fragments.compressor); // done with fragments
 a->scan->rootdir.directory.common.inode->inodeindex=++a->scan->inodes.count;
 if (add_directory_inode_mkfs(a->mkfs,&a->scan->rootdir.directory,NULL)) GOTOERROR;
 if (a->scan->inodes.count!=a->scan->counts.inodes) GOTOERROR;
-a->mkfs->idblocklist.listsize=count_metablock_mkfs(a->mkfs->idblock_table.first)*8;
+a->mkfs->idblocklist.listsize=count_table_mkfs(&a->mkfs->idblock_table)*8;
 #ifdef DEBUG2
 if (a->mkfs->idblocklist.listsize!=(a->scan->ids.count+1023/1024)*8) GOTOERROR;
 #endif
+if (a->mkfs->fragmentlist.count) {
+	a->mkfs->fragmentlist.listsize=count_table_mkfs(&a->mkfs->fragment_table)*8;
+}
+if (a->mkfs->exportlist.refs) {
+	if (fillexport_table_mkfs(a->mkfs)) GOTOERROR;
+}
 
 if (compresstables_mkfs(a->mkfs)) GOTOERROR;
+rootref=inoderef_mkfs(a->mkfs,a->scan->rootdir.directory.common.inode);
 
 
 inode_table_start=a->range->entries.nextstart - archivebase;
 tablesizes=size_table_mkfs(&a->mkfs->inode_table);
+a->stats.bytecounts.inodetable=tablesizes;
 
 // fprintf(stderr,"inode_table_start=%"PRIu64"\n",inode_table_start);
 
 directory_table_start=inode_table_start+tablesizes;
 tablesizes+=size_table_mkfs(&a->mkfs->directory_table);
 
+if (a->mkfs->fragmentlist.count) {
+	fragmentblock_table_start=inode_table_start+tablesizes;
+	tablesizes+=size_table_mkfs(&a->mkfs->fragment_table);
+	fragment_table_start=inode_table_start+tablesizes;
+	tablesizes+=a->mkfs->fragmentlist.listsize;
+}
+if (a->mkfs->exportlist.refs) { // linux expects this between the fragment and id tables
+	exportblock_table_start=inode_table_start+tablesizes;
+	tablesizes+=size_table_mkfs(&a->mkfs->export_table);
+	export_table_start=inode_table_start+tablesizes;
+	tablesizes+=a->mkfs->exportlist.listsize;
+}
+
 #ifdef DEBUG
 idblockoffset=tablesizes;
 #endif
@@ -228,46 +450,48 @@ tablesizes+=a->mkfs->idblocklist.listsize;
 archivesize=inode_table_start+tablesizes;
 pad4k=4095^((archivesize-1)&4095); // aka 4095-((archivesize-1)%4095)
 
-if (!(a->range->extra.other=malloc(tablesizes+pad4k))) GOTOERROR;
+// the inode and directory tables are already laid out, they go in as they are and the rest is copied after them
+othersizes=tablesizes-size_table_mkfs(&a->mkfs->inode_table)-size_table_mkfs(&a->mkfs->directory_table);
+a->range->extra.inodes=takeimage_mkfs(&a->mkfs->inode_table);
+if (add_internal_range(a->range,a->range->extra.inodes,size_table_mkfs(&a->mkfs->inode_table))) GOTOERROR;
+a->range->extra.directories=takeimage_mkfs(&a->mkfs->directory_table);
+if (add_internal_range(a->range,a->range->extra.directories,size_table_mkfs(&a->mkfs->directory_table))) GOTOERROR;
+if (!(a->range->extra.other=malloc(othersizes+pad4k))) GOTOERROR;
 {
 	unsigned char *dest=a->range->extra.other;
-	uint64_t idblockcur;
-	struct metablock_mkfs *metablock;
-	unsigned int bytecount=0;
+	unsigned int bytecount=tablesizes-othersizes;
 
-	(void)copytable_mkfs(&dest,&bytecount,&a->mkfs->inode_table);
-	(void)copytable_mkfs(&dest,&bytecount,&a->mkfs->directory_table);
+	if (a->mkfs->fragmentlist.count) {
+		(void)copytable_mkfs(&dest,&bytecount,&a->mkfs->fragment_table);
+		(void)copylist_mkfs(&dest,&bytecount,&a->mkfs->fragment_table,fragmentblock_table_start);
+	}
+	if (a->mkfs->exportlist.refs) {
+		(void)copytable_mkfs(&dest,&bytecount,&a->mkfs->export_table);
+		(void)copylist_mkfs(&dest,&bytecount,&a->mkfs->export_table,exportblock_table_start);
+	}
 #ifdef DEBUG
 	if (bytecount!=idblockoffset) GOTOERROR;
 #endif
 	(void)copytable_mkfs(&dest,&bytecount,&a->mkfs->idblock_table);
-//	idblockcur=a->range->entries.nextstart+idblockoffset;
-	idblockcur=idblock_table_start;
-	metablock=a->mkfs->idblock_table.first;
-#define setu64(a,b) *(uint64_t*)(a)=htole64(b)
-	while (1) {
-		setu64(dest,idblockcur);
-		dest+=8;
-		bytecount+=8;
-
-		idblockcur+=2+almost_size_metablock_mkfs(metablock);
-
-		metablock=metablock->next;
-		if (!metablock) break;
-	}
+	(void)copylist_mkfs(&dest,&bytecount,&a->mkfs->idblock_table,idblock_table_start);
 	if (bytecount!=tablesizes) GOTOERROR;
 	memset(dest,0,pad4k);
 }
-if (add_internal_range(a->range,a->range->extra.other,tablesizes+pad4k)) GOTOERROR;
+if (add_internal_range(a->range,a->range->extra.other,othersizes+pad4k)) GOTOERROR;
 
 sb.magic=0x73717368;
 sb.inode_count=a->scan->inodes.count;
 sb.modification_time=(unsigned int)time(NULL);
 sb.block_size=a->blocksize;
-sb.fragment_entry_count=0;
-sb.compression_id=1;
+sb.fragment_entry_count=a->mkfs->fragmentlist.count;
+sb.compression_id=(compress->level)?compress->id:GZIP_ID_COMPRESS; // nothing is compressed otherwise
 sb.block_log=a->log_blocksize;
-sb.flags=DEFAULT_FLAGS_SQFS_MKFS; // only "0x0400: Compressor options" is necessary, not present
+sb.flags=DEFAULT_FLAGS_SQFS_MKFS; // only "0x0400: Compressor options" is necessary
+if (optionsize) sb.flags|=0x0400;
+if (a->mkfs->stats.compressedfiles) sb.flags&=~0x0002; // data blocks aren't all uncompressed
+if (a->mkfs->fragmentlist.count) sb.flags&=~0x0010; // there are fragments
+if (a->mkfs->stats.compressedfragments) sb.flags&=~0x0008; // and they aren't all uncompressed
+if (a->mkfs->exportlist.refs) sb.flags|=0x0080; // exportable, there's an inode lookup table
 sb.id_count=a->scan->ids.count;
 sb.version_major=4;
 sb.version_minor=0;
@@ -277,13 +501,13 @@ sb.id_table_start=id_table_start;
 sb.attr_id_table_start=0xFFFFFFFFFFFFFFFF;
 sb.inode_table_start=inode_table_start;
 sb.directory_table_start=directory_table_start;
-sb.fragment_table_start=0xFFFFFFFFFFFFFFFF;
-sb.export_table_start=0xFFFFFFFFFFFFFFFF;
+sb.fragment_table_start=fragment_table_start;
+sb.export_table_start=export_table_start;
 (void)fill_superblock_sqfs_mkfs(superblock,&sb);
 
 a->stats.bytecounts.archive=sb.bytes_used;
-a->stats.bytecounts.files=inode_table_start-NUM_SUPERBLOCK_SQFS_MKFS;
-a->stats.bytecounts.squashfs=tablesizes+NUM_SUPERBLOCK_SQFS_MKFS;
+a->stats.bytecounts.files=inode_table_start-NUM_SUPERBLOCK_SQFS_MKFS-optionsize;
+a->stats.bytecounts.squashfs=tablesizes+NUM_SUPERBLOCK_SQFS_MKFS+optionsize;
 a->stats.bytecounts.padding=pad4k;
 a->stats.bytecounts.bytessaved=a->mkfs->stats.bytessaved;
 
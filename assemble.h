@@ -18,10 +18,12 @@
  */
 struct assemble {
 	int isbuilt:1;
+	int isexporttable:1; // write the inode lookup table, for nfs and the like
 	struct {
 		struct {
 			uint64_t archive,files;
 			unsigned int squashfs,padding;
+			unsigned int inodetable; // compressed size, this grows with the block count
 			unsigned int bytessaved;
 		} bytecounts;
 	} stats;
@@ -31,8 +33,20 @@ struct assemble {
 
 	unsigned int blocksize; // default:128k
 	unsigned int log_blocksize; // log_2(.blocksize)
+	uint64_t archivebase; // range offset of the superblock
+
+	struct {
+		int isenabled:1;
+		struct compress compressor; // not .isinit => store fragment blocks uncompressed
+		unsigned char *block; // tails are packed here until it's full, .blocksize bytes
+		unsigned int fill;
+		unsigned char *spare; // for compressing .block, .blocksize bytes
+		unsigned int files; // files with a tail in a fragment
+	} fragments;
 };
 
 void voidinit_assemble(struct assemble *a, struct scan *s, struct temp_sqfs_mkfs *m, struct range *r, unsigned int blocksize);
-#define deinit_assemble(a) do{}while(0)
+void deinit_assemble(struct assemble *a);
+int setfragments_assemble(struct assemble *a, struct config_compress *compress);
+void setexporttable_assemble(struct assemble *a);
 int build_assemble(struct assemble *a);
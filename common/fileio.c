@@ -0,0 +1,74 @@
+/*
+ * common/fileio.c - whole reads and writes, retrying short counts and EINTR
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include "conventions.h"
+
+#include "fileio.h"
+
+int writen(int fd, unsigned char *msg, unsigned int len) {
+while (len) {
+	ssize_t k;
+	k=write(fd,(char *)msg,len);
+	if (k<1) {
+		if ((k<0) && (errno==EINTR)) continue;
+		return -1;
+	}
+	len-=k;
+	msg+=k;
+}
+return 0;
+}
+int readn(int fd, unsigned char *msg, unsigned int len) {
+while (len) {
+	ssize_t k;
+	k=read(fd,(char *)msg,len);
+	if (k<1) {
+		if ((k<0) && (errno==EINTR)) continue;
+		return -1;
+	}
+	len-=k;
+	msg+=k;
+}
+return 0;
+}
+
+int preadn(int fd, unsigned char *dest, unsigned int n, uint64_t offset, unsigned int *got_out) {
+// got_out: NULL => the file ending early is an error, else it gets the count, short only at the end of the file
+unsigned int got=0;
+while (got<n) {
+	ssize_t k;
+	k=pread64(fd,dest+got,n-got,offset+got);
+	if (k<=0) {
+		if ((k<0)&&(errno==EINTR)) continue;
+		if ((k<0)||(!got_out)) GOTOERROR;
+		break;
+	}
+	got+=k;
+}
+if (got_out) *got_out=got;
+return 0;
+error:
+	return -1;
+}
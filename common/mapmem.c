@@ -16,10 +16,12 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 // #define DEBUG2
 #include "conventions.h"
@@ -32,9 +34,18 @@
 #define FLAGS (MAP_PRIVATE|MAP_ANONYMOUS)
 #endif
 
-static struct node_mapmem *makenode(unsigned int size) {
+static struct node_mapmem *makenode(unsigned int size, char *spilldir) {
 struct node_mapmem *ptr;
-if (MAP_FAILED==(ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,FLAGS,-1,0))) GOTOERROR;
+if (spilldir) { // an unlinked file, the kernel can write it out and drop it when memory is tight
+	int fd;
+	if (0>(fd=open(spilldir,O_RDWR|O_TMPFILE|O_EXCL,0600))) GOTOERROR;
+	if (posix_fallocate(fd,0,size)) { (ignore)close(fd); GOTOERROR; } // ENOSPC now instead of SIGBUS later
+	ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	(ignore)close(fd);
+	if (ptr==MAP_FAILED) GOTOERROR;
+} else {
+	if (MAP_FAILED==(ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,FLAGS,-1,0))) GOTOERROR;
+}
 ptr->num=sizeof(struct node_mapmem);
 ptr->max=size;
 ptr->next=NULL;
@@ -46,17 +57,23 @@ error:
 	return NULL;
 }
 
-int init_mapmem(struct mapmem *m, unsigned int size) {
+int init2_mapmem(struct mapmem *m, unsigned int size, char *spilldir) {
+// spilldir: NULL => anonymous memory, otherwise nodes are backed by unlinked files there
 if (size<sizeof(struct node_mapmem)) size=DEFAULTSIZE_MAPMEM;
-if (!(m->current=m->first=makenode(size))) GOTOERROR;
+m->spilldir=spilldir;
+if (!(m->current=m->first=makenode(size,spilldir))) GOTOERROR;
 return 0;
 error:
 	return -1;
 }
 
+int init_mapmem(struct mapmem *m, unsigned int size) {
+return init2_mapmem(m,size,NULL);
+}
+
 void deinit_mapmem(struct mapmem *m) {
 struct node_mapmem *cur,*next;
-cur=m->current;
+cur=m->first;
 while (cur) {
 	next=cur->next;
 #ifdef DEBUG2
@@ -68,6 +85,15 @@ while (cur) {
 }
 }
 
+void merge_mapmem(struct mapmem *dest, struct mapmem *src) {
+// dest takes over src's memory, src is left empty
+if (!src->first) return;
+if (!dest->first) dest->first=src->first;
+else dest->current->next=src->first;
+dest->current=src->current;
+src->first=src->current=NULL;
+}
+
 void *alloc_mapmem(struct mapmem *m, unsigned int size) {
 struct node_mapmem *node;
 unsigned int max;
@@ -80,8 +106,8 @@ if (node->num+size<=node->max) {
 	return ret;
 }
 max=m->first->max;
-while (max<size) max+=m->first->max;
-if (!(node=makenode(max))) GOTOERROR;
+while (max<size+sizeof(struct node_mapmem)) max+=m->first->max;
+if (!(node=makenode(max,m->spilldir))) GOTOERROR;
 m->current->next=node;
 m->current=node;
 ret=(void *)node+node->num;
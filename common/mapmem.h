@@ -23,11 +23,14 @@ struct node_mapmem {
 
 struct mapmem {
 	struct node_mapmem *current,*first;
+	char *spilldir; // not copied, NULL => anonymous memory
 };
 #define DEFAULTSIZE_MAPMEM	(1<<24)
 
 int init_mapmem(struct mapmem *mapmem, unsigned int size);
+int init2_mapmem(struct mapmem *mapmem, unsigned int size, char *spilldir);
 void deinit_mapmem(struct mapmem *m);
+void merge_mapmem(struct mapmem *dest, struct mapmem *src);
 #define S_MAPMEM(a,b) (b*)alloc_mapmem(a,sizeof(b))
 void *alloc_mapmem(struct mapmem *m, unsigned int size);
 unsigned char *memdup_mapmem(struct mapmem *m, unsigned char *str, unsigned int len);
@@ -30,38 +30,282 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <syslog.h>
+#include <pthread.h>
 #include "conventions.h"
+#include "fileio.h"
 
 #include "mmapread.h"
 
-static inline int readn(int fd, unsigned char *dest, unsigned int n) {
-int k;
-while (n) {
-	k=read(fd,dest,n);
-	if (k<=0) GOTOERROR;
-	dest+=k;
-	n-=k;
+#define MAXBUFFER_MMAPREAD	(1<<22)
+
+struct prefetch_mmapread {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int isquit;
+	int fd;
+	struct buffer_mmapread *job; // NULL => idle
+	unsigned int want;
+};
+
+static void *prefetch_thread(void *arg) {
+struct prefetch_mmapread *p=(struct prefetch_mmapread*)arg;
+(ignore)pthread_mutex_lock(&p->mutex);
+while (1) {
+	struct buffer_mmapread *b;
+	int fd;
+	unsigned int want;
+	if (p->isquit) break;
+	if (!p->job) {
+		(ignore)pthread_cond_wait(&p->cond,&p->mutex);
+		continue;
+	}
+	b=p->job;
+	fd=p->fd;
+	want=p->want;
+	(ignore)pthread_mutex_unlock(&p->mutex);
+	if (preadn(fd,b->data,want,b->offset,NULL)) want=0; // a failed prefetch is just a miss later
+	(ignore)pthread_mutex_lock(&p->mutex);
+	b->len=want;
+	p->job=NULL;
+	(ignore)pthread_cond_broadcast(&p->cond);
+}
+(ignore)pthread_mutex_unlock(&p->mutex);
+return NULL;
+}
+
+static int startthread(struct mmapread *s) {
+struct prefetch_mmapread *p;
+if (!(p=malloc(sizeof(struct prefetch_mmapread)))) GOTOERROR;
+memset(p,0,sizeof(struct prefetch_mmapread));
+if (pthread_mutex_init(&p->mutex,NULL)) { free(p); GOTOERROR; }
+if (pthread_cond_init(&p->cond,NULL)) { (ignore)pthread_mutex_destroy(&p->mutex); free(p); GOTOERROR; }
+if (pthread_create(&p->thread,NULL,prefetch_thread,p)) {
+	(ignore)pthread_cond_destroy(&p->cond);
+	(ignore)pthread_mutex_destroy(&p->mutex);
+	free(p);
+	GOTOERROR;
+}
+s->pread.prefetch=p;
+return 0;
+error:
+	return -1;
+}
+
+static void stopthread(struct mmapread *s) {
+struct prefetch_mmapread *p;
+p=s->pread.prefetch;
+if (!p) return;
+(ignore)pthread_mutex_lock(&p->mutex);
+p->isquit=1;
+(ignore)pthread_cond_broadcast(&p->cond);
+(ignore)pthread_mutex_unlock(&p->mutex);
+(ignore)pthread_join(p->thread,NULL);
+(ignore)pthread_cond_destroy(&p->cond);
+(ignore)pthread_mutex_destroy(&p->mutex);
+free(p);
+s->pread.prefetch=NULL;
+s->pread.loading=NULL;
 }
+
+static void waitprefetch(struct mmapread *s, int iswait) {
+// iswait => block until the prefetch is done, else only check if it is
+struct prefetch_mmapread *p;
+if (!s->pread.loading) return;
+p=s->pread.prefetch;
+(ignore)pthread_mutex_lock(&p->mutex);
+if (iswait) while (p->job) (ignore)pthread_cond_wait(&p->cond,&p->mutex);
+if (!p->job) s->pread.loading=NULL;
+(ignore)pthread_mutex_unlock(&p->mutex);
+}
+
+static struct buffer_mmapread *findbuffer(struct mmapread *s, uint64_t offset) {
+struct buffer_mmapread *b;
+int i;
+for (i=0;i<NUM_BUFFERS_MMAPREAD;i++) {
+	b=&s->pread.list[i];
+	if (b==s->pread.loading) continue;
+	if (offset<b->offset) continue;
+	if (offset>=b->offset+b->len) continue;
+	return b;
+}
+return NULL;
+}
+
+static struct buffer_mmapread *lrubuffer(struct mmapread *s) {
+struct buffer_mmapread *b,*lru=NULL;
+int i;
+for (i=0;i<NUM_BUFFERS_MMAPREAD;i++) {
+	b=&s->pread.list[i];
+	if (b==s->pread.loading) continue;
+	if (!lru || (b->stamp<lru->stamp)) lru=b;
+}
+return lru;
+}
+
+static int sizebuffer(struct buffer_mmapread *b, unsigned int size) {
+unsigned char *temp;
+if (b->max>=size) return 0;
+if (!(temp=realloc(b->data,size))) GOTOERROR;
+b->data=temp;
+b->max=size;
+return 0;
+error:
+	return -1;
+}
+
+static void setdata(struct mmapread *s, struct buffer_mmapread *b, uint64_t offset) {
+uint64_t adj;
+adj=offset-b->offset;
+s->data=b->data+adj;
+s->datasize=b->len-adj;
+}
+
+static void startprefetch(struct mmapread *s, uint64_t offset) {
+// read the next buffer in the background while the reader works through this one
+struct prefetch_mmapread *p;
+struct buffer_mmapread *b;
+unsigned int want;
+if (s->pread.loading) return;
+if (findbuffer(s,offset)) return;
+want=s->pread.size;
+if (offset+want>s->filesize) want=(unsigned int)(s->filesize-offset);
+b=lrubuffer(s);
+b->len=0;
+if (sizebuffer(b,s->pread.size)) return;
+if (!s->pread.prefetch) {
+	if (startthread(s)) return;
+}
+p=s->pread.prefetch;
+b->offset=offset;
+b->stamp=++s->pread.stamp;
+(ignore)pthread_mutex_lock(&p->mutex);
+p->fd=s->fd;
+p->want=want;
+p->job=b;
+(ignore)pthread_cond_broadcast(&p->cond);
+(ignore)pthread_mutex_unlock(&p->mutex);
+s->pread.loading=b;
+s->pread.loadingsize=want;
+}
+
+static int fill(struct mmapread *s, uint64_t offset) {
+// offset < .filesize
+struct buffer_mmapread *b;
+int issequential;
+
+issequential=(offset>=s->pread.nextseq)&&(offset-s->pread.nextseq<s->pread.size);
+if (issequential) {
+	if (s->pread.size<MAXBUFFER_MMAPREAD) s->pread.size<<=1;
+} else {
+	s->pread.size=s->pread.minsize;
+}
+if (s->pread.loading) {
+	struct buffer_mmapread *l=s->pread.loading;
+	(void)waitprefetch(s,(offset>=l->offset)&&(offset<l->offset+s->pread.loadingsize));
+}
+if (!(b=findbuffer(s,offset))) {
+	uint64_t start;
+	unsigned int want;
+	start=offset&~4095;
+	want=s->pread.size;
+	if (start+want>s->filesize) want=(unsigned int)(s->filesize-start);
+	b=lrubuffer(s);
+	b->len=0;
+	if (sizebuffer(b,s->pread.size)) GOTOERROR;
+	if (preadn(s->fd,b->data,want,start,NULL)) GOTOERROR;
+	b->offset=start;
+	b->len=want;
+}
+b->stamp=++s->pread.stamp;
+s->pread.nextseq=b->offset+b->len;
+(void)setdata(s,b,offset);
+if (issequential && (s->pread.nextseq<s->filesize)) (void)startprefetch(s,s->pread.nextseq);
 return 0;
 error:
 	return -1;
 }
 
 static int readoff_nommap(struct mmapread *s, int fd, uint64_t offset, uint64_t filesize) {
-uint64_t u,smoff;
-u=s->cleanup.mallocsize;
-if (!s->cleanup.ptr_malloc) {
-	if (!u) GOTOERROR;
-	if (!(s->cleanup.ptr_malloc=malloc(u))) GOTOERROR;
-}
-smoff=filesize-offset;
-if (smoff < u) u=smoff;
+// for files that can't be mapped (fuse, some network fs): pread into a few cached buffers
+int i;
+if (!s->pread.minsize) GOTOERROR;
+(void)waitprefetch(s,1);
+for (i=0;i<NUM_BUFFERS_MMAPREAD;i++) s->pread.list[i].len=0;
+s->pread.isactive=1;
+s->pread.size=s->pread.minsize;
+s->pread.nextseq=UINT64_MAX;
 s->filesize=filesize;
-s->datasize=s->cleanup.addrsize=u;
+s->fd=fd;
+if (fill(s,offset)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int mapwindow(struct mmapread *s, uint64_t offset_in, int isahead) {
+// maps .windowsize bytes on half-window alignment, so offset_in has at least half a window after it
+uint64_t offset,addrsize,adj;
+void *ptr;
+
+offset=offset_in&~((s->windowsize>>1)-1);
+addrsize=s->filesize-offset;
+if (addrsize>s->windowsize) addrsize=s->windowsize;
+if (MAP_FAILED==(ptr=mmap(NULL,addrsize,PROT_READ,MAP_SHARED,s->fd,offset))) return -1;
+s->cleanup.ptr_mmap=ptr;
+s->cleanup.addrsize=addrsize;
 s->cleanup.offset=offset;
-if (0>lseek64(fd,offset,SEEK_SET)) GOTOERROR;
-s->data=s->cleanup.ptr_malloc;
-if (readn(fd,s->data,(unsigned int)u)) GOTOERROR;
+adj=offset_in-offset;
+s->data=ptr+adj;
+s->datasize=addrsize-adj;
+if (isahead) { // client walked out of the last window, expect it to keep going
+	(ignore)madvise(ptr,addrsize,MADV_SEQUENTIAL);
+	(ignore)madvise(ptr,addrsize,MADV_WILLNEED);
+}
+return 0;
+}
+
+static int readoff_window(struct mmapread *s, int fd, uint64_t offset, int fdcleanup) {
+off64_t filesize;
+if (0>(filesize=lseek64(fd,0,SEEK_END))) {
+	syslog(LOG_ERR,"Error seeking end of file %s",strerror(errno));
+	GOTOERROR;
+}
+s->filesize=(uint64_t)filesize;
+if (s->filesize<=offset) {
+	s->datasize=0;
+	ignore_ifclose(fdcleanup);
+	return 0;
+}
+s->fd=fd;
+if (mapwindow(s,offset,0)) {
+	if (errno!=ENODEV) GOTOERROR;
+	if (readoff_nommap(s,fd,offset,s->filesize)) GOTOERROR;
+}
+s->cleanup.fd=fdcleanup;
+return 0;
+error:
+	return -1;
+}
+
+int slide_mmapread(struct mmapread *s, uint64_t offset) {
+// move the window within the same file without reopening it
+// returns 0 if moved, 1 if caller should start over, -1 on error
+uint64_t max;
+int isahead;
+if (s->pread.isactive) {
+	if (offset>=s->filesize) return 1;
+	if (fill(s,offset)) GOTOERROR;
+	return 0;
+}
+if (!s->windowsize) return 1;
+if (!s->cleanup.ptr_mmap) return 1;
+if (offset>=s->filesize) return 1;
+max=s->cleanup.offset+s->cleanup.addrsize;
+isahead=(offset>=max) && (offset<max+s->windowsize);
+(ignore)munmap(s->cleanup.ptr_mmap,s->cleanup.addrsize);
+s->cleanup.ptr_mmap=NULL;
+if (mapwindow(s,offset,isahead)) GOTOERROR;
 return 0;
 error:
 	return -1;
@@ -70,6 +314,7 @@ error:
 #if UINTPTR_MAX == 0xffffffffffffffff
 int readoff_mmapread(struct mmapread *s, int fd, uint64_t offset, int fdcleanup) {
 off64_t filesize;
+if (s->windowsize) return readoff_window(s,fd,offset,fdcleanup);
 if (0>(filesize=lseek64(fd,0,SEEK_END))) {
 	syslog(LOG_ERR,"Error seeking end of file %s",strerror(errno));
 	GOTOERROR;
@@ -82,6 +327,7 @@ if (!filesize) {
 }
 s->cleanup.addrsize= s->datasize= s->filesize= (uint64_t)filesize;
 s->cleanup.offset=0;
+s->fd=fd;
 if (MAP_FAILED==(s->data=s->cleanup.ptr_mmap=mmap(NULL,filesize,PROT_READ,MAP_SHARED,fd,0))) {
 	if (errno!=ENODEV) GOTOERROR;
 	if (readoff_nommap(s,fd,offset,s->filesize)) GOTOERROR;
@@ -101,6 +347,8 @@ uint64_t addrsize;
 off64_t filesize,offset;
 // int pagesizem1;
 
+if (s->windowsize) return readoff_window(s,fd,offset_in,fdcleanup);
+
 // pagesizem1=sysconf(_SC_PAGESIZE) -1;
 // offset=offset_in & ~pagesizem1;
 
@@ -132,9 +380,10 @@ else {
 s->filesize=(uint64_t)filesize;
 s->cleanup.addrsize=addrsize;
 s->cleanup.offset=offset;
+s->fd=fd;
 if (MAP_FAILED==(s->cleanup.ptr_mmap=mmap(NULL,addrsize,PROT_READ,MAP_SHARED,fd,offset))) {
 	if (errno!=ENODEV) GOTOERROR;
-	if (readoff_nommap(s,fd,offset,s->filesize)) GOTOERROR;
+	if (readoff_nommap(s,fd,offset_in,s->filesize)) GOTOERROR;
 } else {
 	uint64_t adj;
 	adj=offset_in-offset;
@@ -149,26 +398,39 @@ error:
 #endif
 
 void clear_mmapread(struct mmapread *s) {
-static struct mmapread blank={.cleanup.fd=-1};
+static struct mmapread blank={.fd=-1,.cleanup.fd=-1};
 *s=blank;
 }
 
-void voidinit_mmapread(struct mmapread *s, int mallocsize) {
-s->cleanup.mallocsize=mallocsize;
+void voidinit_mmapread(struct mmapread *s, int mallocsize, uint64_t windowsize) {
+// mallocsize: first read size for files that can't be mapped, it grows for sequential readers
+s->pread.minsize=mallocsize;
 if (sysconf(_SC_PAGESIZE) > (1<<26)) { WHEREAMI; _exit(0); }
+if (windowsize) {
+	while (windowsize&(windowsize-1)) windowsize&=windowsize-1;
+	if (windowsize<(1<<20)) windowsize=1<<20; // half a window should still be many pages
+}
+s->windowsize=windowsize;
+s->fd=s->cleanup.fd=-1;
 }
 
 void deinit_mmapread(struct mmapread *s) {
 if (s->cleanup.ptr_mmap) {
 	(ignore)munmap(s->cleanup.ptr_mmap,s->cleanup.addrsize);
 }
-if (s->cleanup.ptr_malloc) {
-	(ignore)free(s->cleanup.ptr_malloc);
+(void)stopthread(s);
+{
+	int i;
+	for (i=0;i<NUM_BUFFERS_MMAPREAD;i++) {
+		if (s->pread.list[i].data) free(s->pread.list[i].data);
+	}
 }
 ignore_ifclose(s->cleanup.fd);
 }
 
 void reset_mmapread(struct mmapread *s) {
+(void)waitprefetch(s,1); // the thread may still be reading from our fd
+s->pread.isactive=0;
 if (s->cleanup.ptr_mmap) {
 	(ignore)munmap(s->cleanup.ptr_mmap,s->cleanup.addrsize);
 	s->cleanup.ptr_mmap=NULL;
@@ -177,22 +439,91 @@ if (s->cleanup.fd>=0) {
 	(ignore)close(s->cleanup.fd);
 	s->cleanup.fd=-1;
 }
+s->fd=-1;
+s->dropbehind.isenabled=0;
+}
+
+#define CHUNK_DROPBEHIND	(1<<22)
+#define MIN_READAHEAD	(1<<17)
+void startstream_mmapread(struct mmapread *s, uint64_t offset, unsigned int maxreadahead, int isdropbehind) {
+// maxreadahead: 0 => no read-ahead
+s->stream.last=s->stream.ahead=offset;
+s->stream.maxwindow=maxreadahead;
+s->stream.window=MIN_READAHEAD;
+if (isdropbehind) {
+	s->dropbehind.isenabled=1;
+	s->dropbehind.dropped=offset&~(CHUNK_DROPBEHIND-1);
+}
+}
+
+static void askahead(struct mmapread *s, uint64_t offset) {
+// ask for the next window before the reader gets there, the window doubles each time it's nearly used up
+uint64_t u;
+if (offset+(s->stream.window>>1) < s->stream.ahead) return;
+if (s->stream.ahead<offset) s->stream.ahead=offset;
+if (s->stream.ahead>=s->filesize) return;
+u=s->filesize-s->stream.ahead;
+if (u>s->stream.window) u=s->stream.window;
+(ignore)posix_fadvise(s->fd,s->stream.ahead,u,POSIX_FADV_WILLNEED); // starts i/o without waiting for it
+s->stream.ahead+=u;
+if (s->stream.window<s->stream.maxwindow) {
+	s->stream.window<<=1;
+	if (s->stream.window>s->stream.maxwindow) s->stream.window=s->stream.maxwindow;
+}
+}
+
+static void dropbehind(struct mmapread *s, uint64_t offset) {
+// for streamed files: release the page cache behind the reader so other files stay cached
+uint64_t start,end;
+if (offset<2*CHUNK_DROPBEHIND) return;
+end=(offset-CHUNK_DROPBEHIND)&~(CHUNK_DROPBEHIND-1); // keep a chunk behind us for small back-seeks
+start=s->dropbehind.dropped;
+if (end<=start) return;
+if (s->cleanup.ptr_mmap) { // pages we still have mapped wouldn't be released
+	uint64_t a,b;
+	a=start;
+	if (a<s->cleanup.offset) a=s->cleanup.offset;
+	b=s->cleanup.offset+s->cleanup.addrsize;
+	if (b>end) b=end;
+	if (a<b) (ignore)madvise(s->cleanup.ptr_mmap+(a-s->cleanup.offset),b-a,MADV_DONTNEED);
+}
+(ignore)posix_fadvise(s->fd,start,end-start,POSIX_FADV_DONTNEED);
+s->dropbehind.dropped=end;
+}
+
+void stream_mmapread(struct mmapread *s, uint64_t offset) {
+// call this for every read of the current file
+uint64_t last;
+last=s->stream.last;
+if (offset<last) {
+	if (last-offset<=CHUNK_DROPBEHIND) return; // requests arriving out of order, still the same stream
+} else if (offset-last<=CHUNK_DROPBEHIND) {
+	s->stream.last=offset;
+	if (s->stream.maxwindow) (void)askahead(s,offset);
+	if (s->dropbehind.isenabled) (void)dropbehind(s,offset);
+	return;
+}
+// a seek, not a stream
+s->stream.last=offset;
+s->stream.ahead=offset;
+s->stream.window=MIN_READAHEAD;
+offset&=~(CHUNK_DROPBEHIND-1);
+if (offset<s->dropbehind.dropped) s->dropbehind.dropped=offset; // skipped chunks get dropped once we pass them
 }
 
 int isoffsetchanged_mmapread(struct mmapread *s, uint64_t offset) {
 uint64_t max;
+if (s->pread.isactive) {
+	struct buffer_mmapread *b;
+	if (!(b=findbuffer(s,offset))) return 0;
+	(void)setdata(s,b,offset);
+	return 1;
+}
+if (!s->cleanup.ptr_mmap) return 0;
 if (offset < s->cleanup.offset) return 0;
 max=s->cleanup.offset+s->cleanup.addrsize;
 if (max <= offset) return 0;
-if (s->cleanup.ptr_mmap) {
-	s->data=s->cleanup.ptr_mmap+offset-s->cleanup.offset;
-	s->datasize=max-offset;
-	return 1;
-}
-if (s->cleanup.ptr_malloc) {
-	s->data=s->cleanup.ptr_malloc+offset-s->cleanup.offset;
-	s->datasize=max-offset;
-	return 1;
-}
-return 0;
+s->data=s->cleanup.ptr_mmap+offset-s->cleanup.offset;
+s->datasize=max-offset;
+return 1;
 }
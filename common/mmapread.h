@@ -16,22 +16,53 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define NUM_BUFFERS_MMAPREAD	4
+struct buffer_mmapread {
+	unsigned char *data;
+	uint64_t offset;
+	unsigned int len,max; // .len is valid data, .max is allocated
+	unsigned int stamp; // for lru
+};
+struct prefetch_mmapread;
+
 struct mmapread {
 	uint64_t filesize;
 	uint64_t datasize; // may not be full size on 32bit or on filesystems without mmap
 	unsigned char *data;
+	uint64_t windowsize; // 0 => map whole file on 64bit, else a power of 2
+	int fd; // fd behind .data, closed by .cleanup.fd if we own it
+	struct {
+		uint64_t last; // offset of the previous read
+		uint64_t ahead; // read-ahead has been requested up to here
+		unsigned int window,maxwindow; // size of the next read-ahead, grows while the reader is sequential
+	} stream;
+	struct {
+		int isenabled:1;
+		uint64_t dropped; // page cache before this has been released
+	} dropbehind;
+	struct {
+		int isactive:1; // reading with pread, the file couldn't be mapped
+		unsigned int minsize,size; // size of the next read, grows while the reader is sequential
+		unsigned int stamp;
+		uint64_t nextseq; // end of the buffer the reader is in
+		struct buffer_mmapread list[NUM_BUFFERS_MMAPREAD];
+		struct buffer_mmapread *loading; // being filled by .prefetch, not to be touched until it's done
+		unsigned int loadingsize;
+		struct prefetch_mmapread *prefetch; // started on first sequential use
+	} pread;
 	struct {
 		void *ptr_mmap;
-		void *ptr_malloc;
 		uint64_t addrsize,offset;
 		int fd;
-		unsigned int mallocsize;
 	} cleanup;
 };
-#define overclear_mmapread(a) do { (a)->cleanup.fd=-1; } while (0)
+#define overclear_mmapread(a) do { (a)->fd=(a)->cleanup.fd=-1; } while (0)
 void clear_mmapread(struct mmapread *s);
-void voidinit_mmapread(struct mmapread *s, int mallocsize);
+void voidinit_mmapread(struct mmapread *s, int mallocsize, uint64_t windowsize);
 void deinit_mmapread(struct mmapread *s);
 void reset_mmapread(struct mmapread *s);
 int readoff_mmapread(struct mmapread *s, int fd, uint64_t offset, int fdcleanup);
 int isoffsetchanged_mmapread(struct mmapread *s, uint64_t offset);
+int slide_mmapread(struct mmapread *s, uint64_t offset);
+void startstream_mmapread(struct mmapread *s, uint64_t offset, unsigned int maxreadahead, int isdropbehind);
+void stream_mmapread(struct mmapread *s, uint64_t offset);
@@ -0,0 +1,140 @@
+/*
+ * common/uring.c - minimal io_uring, for batches of syscalls
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifdef HAVEIOURING
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "conventions.h"
+
+#include "uring.h"
+
+#define load_acquire(a) __atomic_load_n(a,__ATOMIC_ACQUIRE)
+#define store_release(a,b) __atomic_store_n(a,b,__ATOMIC_RELEASE)
+
+int init_uring(struct uring *u, unsigned int entries) {
+// this fails quietly if the kernel doesn't have io_uring or it's blocked, callers should fall back to plain syscalls
+struct io_uring_params params;
+int fd;
+
+memset(u,0,sizeof(struct uring));
+u->fd=-1;
+memset(&params,0,sizeof(params));
+if (0>(fd=syscall(__NR_io_uring_setup,entries,&params))) return -1;
+u->fd=fd;
+u->entries=params.sq_entries;
+
+u->sqmapsize=params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+u->cqmapsize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+u->sqesmapsize=params.sq_entries*sizeof(struct io_uring_sqe);
+if (MAP_FAILED==(u->sqmap=mmap(NULL,u->sqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING))) {
+	u->sqmap=NULL;
+	GOTOERROR;
+}
+if (MAP_FAILED==(u->cqmap=mmap(NULL,u->cqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING))) {
+	u->cqmap=NULL;
+	GOTOERROR;
+}
+if (MAP_FAILED==(u->sqes=mmap(NULL,u->sqesmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES))) {
+	u->sqes=NULL;
+	GOTOERROR;
+}
+
+u->sqhead_ring=u->sqmap+params.sq_off.head;
+u->sqtail_ring=u->sqmap+params.sq_off.tail;
+u->sqmask=u->sqmap+params.sq_off.ring_mask;
+u->sqarray=u->sqmap+params.sq_off.array;
+u->cqhead_ring=u->cqmap+params.cq_off.head;
+u->cqtail_ring=u->cqmap+params.cq_off.tail;
+u->cqmask=u->cqmap+params.cq_off.ring_mask;
+u->cqes=u->cqmap+params.cq_off.cqes;
+u->sqtail=*u->sqtail_ring;
+return 0;
+error:
+	deinit_uring(u);
+	return -1;
+}
+
+void deinit_uring(struct uring *u) {
+if (u->sqes) (ignore)munmap(u->sqes,u->sqesmapsize);
+if (u->cqmap) (ignore)munmap(u->cqmap,u->cqmapsize);
+if (u->sqmap) (ignore)munmap(u->sqmap,u->sqmapsize);
+ignore_ifclose(u->fd);
+}
+
+struct io_uring_sqe *getsqe_uring(struct uring *u) {
+// NULL if the submission queue is full, the sqe is cleared
+struct io_uring_sqe *sqe;
+unsigned int index;
+if (u->sqtail-load_acquire(u->sqhead_ring)>=u->entries) return NULL;
+index=u->sqtail&*u->sqmask;
+sqe=&u->sqes[index];
+memset(sqe,0,sizeof(struct io_uring_sqe));
+u->sqarray[index]=index;
+u->sqtail+=1;
+u->pending+=1;
+return sqe;
+}
+
+int wait_uring(struct uring *u) {
+// submits what's pending and waits for at least one completion
+int r;
+store_release(u->sqtail_ring,u->sqtail);
+while (1) {
+	r=syscall(__NR_io_uring_enter,u->fd,u->pending,1,IORING_ENTER_GETEVENTS,NULL,0);
+	if (r>=0) break;
+	if (errno!=EINTR) GOTOERROR;
+}
+u->pending-=r;
+return 0;
+error:
+	return -1;
+}
+
+int reap_uring(struct uring *u) {
+// waits for at least one completion without submitting anything
+int r;
+while (1) {
+	r=syscall(__NR_io_uring_enter,u->fd,0,1,IORING_ENTER_GETEVENTS,NULL,0);
+	if (r>=0) break;
+	if (errno!=EINTR) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+int getcqe_uring(uint64_t *userdata_out, int *res_out, struct uring *u) {
+// 0 if nothing has completed, 1 otherwise
+struct io_uring_cqe *cqe;
+unsigned int head;
+head=*u->cqhead_ring;
+if (head==load_acquire(u->cqtail_ring)) return 0;
+cqe=&u->cqes[head&*u->cqmask];
+*userdata_out=cqe->user_data;
+*res_out=cqe->res;
+store_release(u->cqhead_ring,head+1);
+return 1;
+}
+#endif
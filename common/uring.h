@@ -0,0 +1,37 @@
+/*
+ * common/uring.h
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+struct uring { // a bare io_uring, without liburing
+	int fd;
+	unsigned int entries;
+	unsigned int pending; // sqes queued but not yet submitted
+	unsigned int sqtail;
+	unsigned int *sqhead_ring,*sqtail_ring,*sqmask,*sqarray;
+	unsigned int *cqhead_ring,*cqtail_ring,*cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap,*cqmap;
+	unsigned int sqmapsize,cqmapsize,sqesmapsize;
+};
+
+int init_uring(struct uring *u, unsigned int entries);
+void deinit_uring(struct uring *u);
+struct io_uring_sqe *getsqe_uring(struct uring *u);
+int wait_uring(struct uring *u);
+int reap_uring(struct uring *u);
+int getcqe_uring(uint64_t *userdata_out, int *res_out, struct uring *u);
@@ -0,0 +1,217 @@
+/*
+ * compress.c - block compressors for the squashfs image
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <endian.h>
+#include <syslog.h>
+#include <zlib.h>
+#ifdef HAVEXZ
+#include <lzma.h>
+#endif
+#ifdef HAVELZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVEZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#include "common/conventions.h"
+
+#include "compress.h"
+
+#define setu32(a,b) *(uint32_t*)(a)=htole32(b)
+
+int parse_compress(unsigned int *id_out, char *name) {
+unsigned int id;
+if (!strncasecmp(name,"gzip",4)) id=GZIP_ID_COMPRESS;
+else if (!strncasecmp(name,"zlib",4)) id=GZIP_ID_COMPRESS;
+else if (!strncasecmp(name,"xz",2)) id=XZ_ID_COMPRESS;
+else if (!strncasecmp(name,"lz4",3)) id=LZ4_ID_COMPRESS;
+else if (!strncasecmp(name,"zstd",4)) id=ZSTD_ID_COMPRESS;
+else {
+	syslog(LOG_ERR,"Unknown compressor \"%s\"",name);
+	GOTOERROR;
+}
+switch (id) {
+#ifdef HAVEXZ
+	case XZ_ID_COMPRESS:
+#endif
+#ifdef HAVELZ4
+	case LZ4_ID_COMPRESS:
+#endif
+#ifdef HAVEZSTD
+	case ZSTD_ID_COMPRESS:
+#endif
+	case GZIP_ID_COMPRESS: break;
+	default:
+		syslog(LOG_ERR,"Compressor \"%s\" isn't compiled in, see Makefile",name);
+		GOTOERROR;
+}
+*id_out=id;
+return 0;
+error:
+	return -1;
+}
+
+unsigned int defaultlevel_compress(unsigned int id) {
+switch (id) {
+	case XZ_ID_COMPRESS: return 6; // preset
+	case LZ4_ID_COMPRESS: return 1; // 1 is plain lz4, higher is lz4hc at that level
+	case ZSTD_ID_COMPRESS: return 15;
+}
+return 6;
+}
+
+int init_compress(struct compress *c, struct config_compress *config) {
+// c should be cleared, deinit_compress is safe after an error
+c->config=*config;
+if (!config->level) return 0;
+switch (config->id) {
+	case GZIP_ID_COMPRESS:
+		if (Z_OK!=deflateInit(&c->zstream,(config->level>9)?9:config->level)) GOTOERROR;
+		break;
+#ifdef HAVEXZ
+	case XZ_ID_COMPRESS: break; // the encoder is set up per block
+#endif
+#ifdef HAVELZ4
+	case LZ4_ID_COMPRESS: break;
+#endif
+#ifdef HAVEZSTD
+	case ZSTD_ID_COMPRESS:
+		if (!(c->zstd=ZSTD_createCCtx())) GOTOERROR;
+		break;
+#endif
+	default: GOTOERROR;
+}
+c->isinit=1;
+return 0;
+error:
+	return -1;
+}
+
+void deinit_compress(struct compress *c) {
+// safe to call twice
+if (!c->isinit) return;
+switch (c->config.id) {
+	case GZIP_ID_COMPRESS: (ignore)deflateEnd(&c->zstream); break;
+#ifdef HAVEZSTD
+	case ZSTD_ID_COMPRESS: (ignore)ZSTD_freeCCtx(c->zstd); break;
+#endif
+}
+c->isinit=0;
+}
+
+#ifdef HAVEXZ
+static int xzblock(unsigned int *destlen_out, struct compress *c, unsigned char *dest, unsigned int destmax,
+		unsigned char *src, unsigned int srclen) {
+lzma_options_lzma opts;
+lzma_filter filters[2];
+size_t pos=0;
+lzma_ret r;
+
+if (lzma_lzma_preset(&opts,(c->config.level>9)?9:c->config.level)) GOTOERROR;
+// linux preallocates max(blocksize,8k) for the dictionary when there are no compressor options
+opts.dict_size=(c->config.dictsize<8192)?8192:c->config.dictsize;
+filters[0].id=LZMA_FILTER_LZMA2;
+filters[0].options=&opts;
+filters[1].id=LZMA_VLI_UNKNOWN;
+filters[1].options=NULL;
+r=lzma_stream_buffer_encode(filters,LZMA_CHECK_CRC32,NULL,src,srclen,dest,&pos,destmax);
+if (r==LZMA_BUF_ERROR) pos=0;
+else if (r!=LZMA_OK) GOTOERROR;
+*destlen_out=pos;
+return 0;
+error:
+	return -1;
+}
+#endif
+
+int block_compress(unsigned int *destlen_out, struct compress *c, unsigned char *dest, unsigned int destmax,
+		unsigned char *src, unsigned int srclen) {
+// *destlen_out=0 if it doesn't fit in destmax, pass srclen-1 to only keep results that are smaller
+unsigned int destlen=0;
+
+if (!c->isinit) GOTOERROR;
+switch (c->config.id) {
+	case GZIP_ID_COMPRESS:
+		{
+			struct z_stream_s *zs=&c->zstream;
+			int r;
+			zs->next_in=src;
+			zs->avail_in=srclen;
+			zs->next_out=dest;
+			zs->avail_out=destmax;
+			zs->total_out=0;
+			r=deflate(zs,Z_FINISH);
+			if (r==Z_STREAM_END) destlen=zs->total_out;
+			else if ((r!=Z_OK)&&(r!=Z_BUF_ERROR)) GOTOERROR;
+			if (Z_OK!=deflateReset(zs)) GOTOERROR;
+		}
+		break;
+#ifdef HAVEXZ
+	case XZ_ID_COMPRESS:
+		if (xzblock(&destlen,c,dest,destmax,src,srclen)) GOTOERROR;
+		break;
+#endif
+#ifdef HAVELZ4
+	case LZ4_ID_COMPRESS:
+		{
+			int r;
+			if (c->config.level>1) r=LZ4_compress_HC((char *)src,(char *)dest,srclen,destmax,c->config.level);
+			else r=LZ4_compress_default((char *)src,(char *)dest,srclen,destmax);
+			if (r>0) destlen=r; // 0 => it didn't fit
+		}
+		break;
+#endif
+#ifdef HAVEZSTD
+	case ZSTD_ID_COMPRESS:
+		{
+			size_t r;
+			r=ZSTD_compressCCtx(c->zstd,dest,destmax,src,srclen,c->config.level);
+			if (!ZSTD_isError(r)) destlen=r;
+			else if (ZSTD_getErrorCode(r)!=ZSTD_error_dstSize_tooSmall) GOTOERROR;
+		}
+		break;
+#endif
+	default: GOTOERROR;
+}
+*destlen_out=destlen;
+return 0;
+error:
+	return -1;
+}
+
+unsigned int options_compress(unsigned char *dest, struct config_compress *config) {
+// writes the compressor options block that follows the superblock, returns its size, 0 => none
+switch (config->id) {
+	case LZ4_ID_COMPRESS: // these are required
+		setu32(dest,1); // version: LZ4_LEGACY
+		setu32(dest+4,(config->level>1)?1:0); // flags: LZ4HC
+		return 8;
+	case ZSTD_ID_COMPRESS:
+		setu32(dest,config->level);
+		return 4;
+}
+// gzip and xz defaults match what we write
+return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * compress.h
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define GZIP_ID_COMPRESS	1
+#define XZ_ID_COMPRESS		4
+#define LZ4_ID_COMPRESS		5
+#define ZSTD_ID_COMPRESS	6
+
+#define MAXOPTIONS_COMPRESS	8 // bytes of squashfs compressor options, after the superblock
+
+struct config_compress {
+	unsigned int id; // _ID_COMPRESS, as in the superblock
+	unsigned int level; // 0 => don't compress
+	unsigned int dictsize; // for xz, this is the data block size
+};
+
+struct compress {
+	struct config_compress config;
+	int isinit:1;
+	struct z_stream_s zstream; // gzip
+	void *zstd; // ZSTD_CCtx
+};
+
+int parse_compress(unsigned int *id_out, char *name);
+unsigned int defaultlevel_compress(unsigned int id);
+int init_compress(struct compress *c, struct config_compress *config);
+void deinit_compress(struct compress *c);
+int block_compress(unsigned int *destlen_out, struct compress *c, unsigned char *dest, unsigned int destmax,
+		unsigned char *src, unsigned int srclen);
+unsigned int options_compress(unsigned char *dest, struct config_compress *config);
@@ -0,0 +1,292 @@
+/*
+ * dedup.c - find files with identical contents
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "common/conventions.h"
+#include "common/mapmem.h"
+#include "common/fileio.h"
+#include "options.h"
+#include "scan.h"
+
+#include "dedup.h"
+
+#define BUFFERSIZE_DEDUP	(1<<17)
+#define MAXEXTENTS_DEDUP	32
+// these make physical extents useless for comparing
+#define BADFLAGS_DEDUP	(FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_ENCODED|FIEMAP_EXTENT_DATA_ENCRYPTED\
+		|FIEMAP_EXTENT_NOT_ALIGNED|FIEMAP_EXTENT_DATA_INLINE|FIEMAP_EXTENT_DATA_TAIL|FIEMAP_EXTENT_UNWRITTEN)
+
+struct candidate_dedup {
+	struct file_scan *file;
+	char *path; // full path, NULL if we couldn't find one
+	uint64_t hash; // crc32<<32 | adler32
+	int ishashed:1;
+};
+
+struct walk_dedup {
+	struct scan *scan;
+	struct candidate_dedup *candidates;
+	unsigned int count;
+	unsigned char *buffer1,*buffer2; // BUFFERSIZE_DEDUP each
+	struct fiemap *fiemap1,*fiemap2; // MAXEXTENTS_DEDUP extents each
+};
+
+static void countfiles(unsigned int *count_inout, struct inode_scan *inode) {
+for (;inode;inode=inode->next) {
+	if ((inode->type==FILE_TYPE_SCAN) && inode->file->size) *count_inout+=1;
+}
+}
+
+static void listfiles(struct file_scan **list, unsigned int *count_inout, struct inode_scan *inode) {
+// hardlinks share an inode, so each file is listed once
+for (;inode;inode=inode->next) {
+	if ((inode->type==FILE_TYPE_SCAN) && inode->file->size) {
+		list[*count_inout]=inode->file;
+		*count_inout+=1;
+	}
+}
+}
+
+static int cmp_size(const void *a_in, const void *b_in) {
+struct file_scan *a=*(struct file_scan **)a_in;
+struct file_scan *b=*(struct file_scan **)b_in;
+if (a->size<b->size) return -1;
+if (a->size>b->size) return 1;
+// the inode list's order depends on scan threads, this keeps the choice of original stable
+if (a->common.inode->devnumber!=b->common.inode->devnumber) return _FASTCMP(a->common.inode->devnumber,b->common.inode->devnumber);
+return _FASTCMP(a->common.inode->number,b->common.inode->number);
+}
+
+static int cmp_sizehash(const void *a_in, const void *b_in) {
+const struct candidate_dedup *a=a_in;
+const struct candidate_dedup *b=b_in;
+if (a->file->size<b->file->size) return -1;
+if (a->file->size>b->file->size) return 1;
+if (a->hash<b->hash) return -1;
+if (a->hash>b->hash) return 1;
+return 0;
+}
+
+static char *joinpath(struct mapmem *mapmem, char *dirpath, char *filename, unsigned int filenamelen) {
+char *path;
+unsigned int n;
+n=strlen(dirpath);
+if (!(path=alloc_mapmem(mapmem,n+1+filenamelen+1))) return NULL;
+memcpy(path,dirpath,n);
+path[n]='/';
+memcpy(path+n+1,filename,filenamelen+1);
+return path;
+}
+
+static int walkdir(struct walk_dedup *walk, char *dirpath, struct dirent_scan *de) {
+// finds a path for every candidate
+if (!de) return 0;
+if (walkdir(walk,dirpath,de->treevars.left)) GOTOERROR;
+switch (de->type) {
+	case FILE_TYPE_SCAN:
+		if (de->file->dedupindex) {
+			struct candidate_dedup *c=&walk->candidates[de->file->dedupindex-1];
+			if (c->path) break; // a hardlink we've seen
+			if (de->overlay) c->path=de->overlay;
+			else if (dirpath) {
+				if (!(c->path=joinpath(&walk->scan->mapmem,dirpath,de->filename,de->filenamelen))) GOTOERROR;
+			}
+		}
+		break;
+	case DIRECTORY_TYPE_SCAN:
+		{
+			char *path=NULL; // made up directories only have overlays
+			if (de->overlay) path=de->overlay;
+			else if (dirpath) {
+				if (!(path=joinpath(&walk->scan->mapmem,dirpath,de->filename,de->filenamelen))) GOTOERROR;
+			}
+			if (walkdir(walk,path,de->directory->entries.top)) GOTOERROR;
+		}
+		break;
+}
+if (walkdir(walk,dirpath,de->treevars.right)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static void hashfile(struct walk_dedup *walk, struct candidate_dedup *c) {
+// files that can't be read just aren't deduplicated
+uint64_t offset=0;
+uLong crc,adler;
+int fd;
+
+if (0>(fd=open(c->path,O_RDONLY))) return;
+crc=crc32(0,NULL,0);
+adler=adler32(0,NULL,0);
+while (offset<c->file->size) {
+	unsigned int k;
+	if (preadn(fd,walk->buffer1,BUFFERSIZE_DEDUP,offset,&k) || !k) break;
+	crc=crc32(crc,walk->buffer1,k);
+	adler=adler32(adler,walk->buffer1,k);
+	offset+=k;
+}
+(ignore)close(fd);
+if (offset!=c->file->size) return; // file changed since scan
+c->hash=((uint64_t)crc<<32)|(adler&0xffffffff);
+c->ishashed=1;
+}
+
+static int getextents(struct fiemap *fm, int fd) {
+memset(fm,0,sizeof(struct fiemap));
+fm->fm_length=FIEMAP_MAX_OFFSET;
+fm->fm_extent_count=MAXEXTENTS_DEDUP;
+if (ioctl(fd,FS_IOC_FIEMAP,fm)) return -1;
+return 0;
+}
+
+static int isreflinked(struct walk_dedup *walk, int fd1, int fd2) {
+// 1 if both files are made of the same shared extents, i.e., reflinked copies
+struct fiemap *fm1=walk->fiemap1,*fm2=walk->fiemap2;
+unsigned int ui;
+
+if (getextents(fm1,fd1)) return 0; // e.g., fs doesn't support it
+if (getextents(fm2,fd2)) return 0;
+if (!fm1->fm_mapped_extents) return 0;
+if (fm1->fm_mapped_extents!=fm2->fm_mapped_extents) return 0;
+if (!(fm1->fm_extents[fm1->fm_mapped_extents-1].fe_flags&FIEMAP_EXTENT_LAST)) return 0; // too many to check
+for (ui=0;ui<fm1->fm_mapped_extents;ui++) {
+	struct fiemap_extent *e1=&fm1->fm_extents[ui],*e2=&fm2->fm_extents[ui];
+	if (!(e1->fe_flags&FIEMAP_EXTENT_SHARED)) return 0;
+	if ((e1->fe_flags|e2->fe_flags)&BADFLAGS_DEDUP) return 0;
+	if (e1->fe_logical!=e2->fe_logical) return 0;
+	if (e1->fe_physical!=e2->fe_physical) return 0;
+	if (e1->fe_length!=e2->fe_length) return 0;
+}
+return 1;
+}
+
+static int issame(struct walk_dedup *walk, struct candidate_dedup *a, struct candidate_dedup *b) {
+// hashes matched, this makes sure
+uint64_t offset=0,size=a->file->size;
+int fd1=-1,fd2=-1;
+int r=0;
+
+if (0>(fd1=open(a->path,O_RDONLY))) goto done;
+if (0>(fd2=open(b->path,O_RDONLY))) goto done;
+if (isreflinked(walk,fd1,fd2)) { r=1; goto done; }
+while (offset<size) {
+	unsigned int n,got1,got2;
+	n=BUFFERSIZE_DEDUP;
+	if (size-offset<n) n=size-offset;
+	if (preadn(fd1,walk->buffer1,n,offset,&got1) || (got1!=n)) goto done; // short => file changed since scan
+	if (preadn(fd2,walk->buffer2,n,offset,&got2) || (got2!=n)) goto done;
+	if (memcmp(walk->buffer1,walk->buffer2,n)) goto done;
+	offset+=n;
+}
+r=1;
+done:
+	ignore_ifclose(fd1);
+	ignore_ifclose(fd2);
+	return r;
+}
+
+int build_dedup(struct dedup *dedup, struct scan *scan, struct options *options) {
+// sets file_scan.dupof for files that have the same contents as another file
+struct walk_dedup walk;
+struct file_scan **files=NULL;
+unsigned int count=0,ui;
+
+memset(&walk,0,sizeof(walk));
+memset(&dedup->stats,0,sizeof(dedup->stats));
+walk.scan=scan;
+
+(void)countfiles(&count,scan->inodes.first);
+if (count<2) return 0;
+if (!(files=malloc(count*sizeof(struct file_scan *)))) GOTOERROR;
+count=0;
+(void)listfiles(files,&count,scan->inodes.first);
+qsort(files,count,sizeof(struct file_scan *),cmp_size);
+
+// only files with a same-size peer can have duplicates
+if (!(walk.candidates=ZTMALLOC(count,struct candidate_dedup))) GOTOERROR;
+for (ui=0;ui<count;ui++) {
+	if ( ((ui+1<count) && (files[ui+1]->size==files[ui]->size))
+			|| (ui && (files[ui-1]->size==files[ui]->size)) ) {
+		walk.candidates[walk.count].file=files[ui];
+		walk.count+=1;
+		files[ui]->dedupindex=walk.count;
+	}
+}
+free(files); files=NULL;
+dedup->stats.candidates=walk.count;
+if (!walk.count) goto done;
+
+if (walkdir(&walk,(*scan->rootdir.path)?scan->rootdir.path:NULL,scan->rootdir.directory.entries.top)) GOTOERROR;
+
+if (!(walk.buffer1=malloc(BUFFERSIZE_DEDUP))) GOTOERROR;
+if (!(walk.buffer2=malloc(BUFFERSIZE_DEDUP))) GOTOERROR;
+if (!(walk.fiemap1=malloc(sizeof(struct fiemap)+MAXEXTENTS_DEDUP*sizeof(struct fiemap_extent)))) GOTOERROR;
+if (!(walk.fiemap2=malloc(sizeof(struct fiemap)+MAXEXTENTS_DEDUP*sizeof(struct fiemap_extent)))) GOTOERROR;
+for (ui=0;ui<walk.count;ui++) {
+	struct candidate_dedup *c=&walk.candidates[ui];
+	c->file->dedupindex=0; // indices are invalid after the sort
+	if (c->path) (void)hashfile(&walk,c);
+}
+qsort(walk.candidates,walk.count,sizeof(struct candidate_dedup),cmp_sizehash);
+
+for (ui=0;ui<walk.count;) {
+	struct candidate_dedup *first=&walk.candidates[ui];
+	unsigned int uj;
+	for (uj=ui+1;uj<walk.count;uj++) {
+		struct candidate_dedup *c=&walk.candidates[uj];
+		if (cmp_sizehash(first,c)) break;
+		if (!first->ishashed || !c->ishashed) continue;
+		if (!issame(&walk,first,c)) continue; // a hash collision, rare enough to ignore
+		c->file->dupof=first->file;
+		dedup->stats.files+=1;
+		dedup->stats.bytessaved+=c->file->size;
+	}
+	ui=uj;
+}
+
+done:
+iffree(walk.candidates);
+iffree(walk.buffer1);
+iffree(walk.buffer2);
+iffree(walk.fiemap1);
+iffree(walk.fiemap2);
+return 0;
+error:
+	iffree(files);
+	iffree(walk.candidates);
+	iffree(walk.buffer1);
+	iffree(walk.buffer2);
+	iffree(walk.fiemap1);
+	iffree(walk.fiemap2);
+	return -1;
+}
@@ -0,0 +1,27 @@
+/*
+ * dedup.h
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+struct dedup {
+	struct {
+		unsigned int candidates; // files that had a same-size peer
+		unsigned int files; // files that now share another file's data
+		uint64_t bytessaved;
+	} stats; // for the last build
+};
+
+int build_dedup(struct dedup *dedup, struct scan *scan, struct options *options);
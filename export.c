@@ -35,8 +35,10 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "common/conventions.h"
 #include "common/mmapread.h"
 #include "common/mapmem.h"
@@ -44,15 +46,34 @@
 #include "misc.h"
 #include "options.h"
 #include "scan.h"
+#include "compress.h"
 #include "mkfs.h"
 #include "range.h"
 #include "assemble.h"
+#include "store.h"
+#include "dedup.h"
 
 #include "export.h"
 
+#define MAXTHREADS_PRELOAD	64
+
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT	13
+#endif
+#ifndef IOPRIO_CLASS_BE
+#define IOPRIO_CLASS_BE	2
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE	3
+#endif
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS	1
+#endif
+
 SICLEARFUNC(scan);
 SICLEARFUNC(temp_sqfs_mkfs);
 SICLEARFUNC(assemble);
+SICLEARFUNC(dedup);
 
 int init_all_export(struct all_export *all) {
 // all->config.istlsrequired=0;
@@ -62,11 +83,16 @@ all->defaults.longtimeout=7*24*60*60;
 // all->defaults.isdenydefault=0;
 // all->defaults.ispreload=0;
 all->defaults.isnodelay=1;
+all->defaults.isexporttable=1;
 all->defaults.iskeepalive=1;
 all->defaults.islisted=1;
 // all->defaults.iskeyrequired=0;
 // all->defaults.istlsrequired=0;
 all->defaults.gziplevel=6; // Z_DEFAULT_COMPRESSION = -1, => 6
+all->defaults.compressor=GZIP_ID_COMPRESS;
+all->defaults.log_blocksize=17; // 128k
+all->defaults.mmapwindow=64;
+all->defaults.readahead=16;
 // all->defaults.maxfiles=0; // no max
 if (init_blockmem(&all->tofree.blockmem,8192)) GOTOERROR;
 return 0;
@@ -76,9 +102,11 @@ error:
 
 void deinit_all_export(struct all_export *all) {
 struct one_export *export;
+(ignore)waitpreload_export(all);
 export=all->exports.first;
 while (export) {
 	deinit_range(&export->range);
+	deinit_store(&export->store);
 
 	export=export->next;
 }
@@ -238,7 +266,24 @@ one->iskeepalive=all->defaults.iskeepalive;
 one->islisted=all->defaults.islisted;
 one->iskeyrequired=all->defaults.iskeyrequired;
 one->gziplevel=all->defaults.gziplevel;
+one->compressor=all->defaults.compressor;
+one->compresslevel=all->defaults.compresslevel;
+one->log_blocksize=all->defaults.log_blocksize;
 one->maxfiles=all->defaults.maxfiles;
+one->mmapwindow=all->defaults.mmapwindow;
+one->dropbehind=all->defaults.dropbehind;
+one->readahead=all->defaults.readahead;
+one->iscompressdata=all->defaults.iscompressdata;
+one->isfragments=all->defaults.isfragments;
+one->isdedup=all->defaults.isdedup;
+one->isexporttable=all->defaults.isexporttable;
+one->compressthreads=all->defaults.compressthreads;
+one->scanthreads=all->defaults.scanthreads;
+one->compresscache=all->defaults.compresscache;
+one->spilldir=all->defaults.spilldir;
+one->buildnice=all->defaults.buildnice;
+one->buildio=all->defaults.buildio;
+one->buildrate=all->defaults.buildrate;
 
 one->id=all->exports.count;
 all->exports.count+=1;
@@ -314,19 +359,74 @@ error:
 	return -1;
 }
 
-int build_one_export(struct one_export *one, struct options *options) {
-// check one->isbuilt before calling this
+static void sizehistogram(uint64_t *bytes, struct inode_scan *inode) {
+// bytes[i] is the total size of files with i==log_2(size)
+uint64_t size;
+unsigned int i;
+for (;inode;inode=inode->next) {
+	if ((inode->type==FILE_TYPE_SCAN) && (size=inode->file->size)) {
+		for (i=0;size>1;i++) size>>=1;
+		bytes[i]+=inode->file->size;
+	}
+}
+}
+
+static unsigned int autoblocksize(struct scan *scan) {
+// larger blocks mean fewer block sizes in the inode table and better compression, smaller blocks mean less
+// work per random read. We pick from the file holding the median byte: 128k for files under 8MB, 1M for 32MB+
+uint64_t bytes[64],total=0,sum=0;
+unsigned int i;
+memset(bytes,0,sizeof(bytes));
+(void)sizehistogram(bytes,scan->inodes.first);
+for (i=0;i<64;i++) total+=bytes[i];
+if (!total) return 17;
+for (i=63;i;i--) {
+	sum+=bytes[i];
+	if (sum>=total/2) break;
+}
+if (i<22) return 17;
+if (i>25) return 20;
+return i-5;
+}
+
+static void setcompress(struct config_compress *compress, struct one_export *one, unsigned int blocksize) {
+compress->id=one->compressor;
+compress->dictsize=blocksize;
+if (!one->gziplevel) compress->level=0; // gziplevel=0 turns off all compression
+else if (one->compresslevel) compress->level=one->compresslevel;
+else if (one->compressor==GZIP_ID_COMPRESS) compress->level=one->gziplevel;
+else compress->level=defaultlevel_compress(one->compressor);
+}
+
+static int msecsince(unsigned int *msec_out, struct timespec *start) {
+struct timespec now;
+unsigned int msec;
+if (clock_gettime(CLOCK_MONOTONIC_RAW,&now)) GOTOERROR;
+msec=(now.tv_sec-start->tv_sec)*1000;
+if (now.tv_nsec >= start->tv_nsec) msec+=(now.tv_nsec-start->tv_nsec)/(1000*1000);
+else msec-=(start->tv_nsec-now.tv_nsec)/(1000*1000);
+*msec_out=msec;
+return 0;
+error:
+	return -1;
+}
+
+static int buildexport(struct one_export *one, struct options *options) {
 struct scan scan;
 struct temp_sqfs_mkfs mkfs;
 struct assemble assemble;
+struct dedup dedup;
+struct config_compress compress,nocompress;
 unsigned int log_blocksize=17;
-struct timespec start_time,end_time;
+struct timespec start_time;
 struct chunk_export *chunk;
 uint64_t highestfilestamp=0;
+struct config_range config;
 
 clear_scan(&scan);
 clear_temp_sqfs_mkfs(&mkfs);
 clear_assemble(&assemble);
+clear_dedup(&dedup);
 
 chunk=one->chunks.first;
 #if 0
@@ -335,17 +435,39 @@ if (!(chunk=one->chunks.first)) return 0; // finalize_overlays() obviates this
 
 if (one->chunks.directory) {
 	if (clock_gettime(CLOCK_MONOTONIC_RAW,&start_time)) GOTOERROR;
-	if (init_scan(&scan,(1<<20),one->maxfiles)) GOTOERROR;
+	if (init_scan(&scan,(1<<20),one->maxfiles,one->scanthreads,one->spilldir)) GOTOERROR;
+	(void)setmaxrate_scan(&scan,one->buildrate);
 	if (setrootdir_scan(&scan,one->chunks.directory->directoryname,options)) GOTOERROR;
 	if (applyoverlays(&scan,one,options)) GOTOERROR;
 	// if (finalize_scan(&scan)) GOTOERROR;
-	if (init_temp_sqfs_mkfs(&mkfs,&scan.mapmem,1<<log_blocksize,one->gziplevel)) GOTOERROR;
+	if (one->isdedup) {
+		if (build_dedup(&dedup,&scan,options)) GOTOERROR;
+	}
+	log_blocksize=(one->log_blocksize)?one->log_blocksize:autoblocksize(&scan);
+	(void)setcompress(&compress,one,1<<log_blocksize);
+	nocompress=compress;
+	nocompress.level=0;
+	if (one->iscompressdata && compress.level) {
+		(void)setconfig_store(&one->store,&compress,1<<log_blocksize,(one->isfragments)?(1<<log_blocksize):0,
+				one->compressthreads,one->compresscache);
+		if (compress_store(&one->store,&scan,options)) GOTOERROR;
+	}
+	if (init_temp_sqfs_mkfs(&mkfs,&scan.mapmem,1<<log_blocksize,&compress,one->compressthreads)) GOTOERROR;
 	voidinit_assemble(&assemble,&scan,&mkfs,&one->range,log_blocksize);
-}
-if (init_range(&one->range,3+scan.counts.non0files + (one->chunks.num - 1), // maxentries: 1: superblock, scan.counts.non0files: 1 per file, 1: inodes+dirs+tables, 1: 4k padding
+	if (one->isfragments) {
+		if (setfragments_assemble(&assemble,(one->iscompressdata)?&compress:&nocompress)) GOTOERROR;
+	}
+	if (one->isexporttable) (void)setexporttable_assemble(&assemble);
+}
+config.mmapwindow=(uint64_t)one->mmapwindow<<20;
+config.dropbehind=(uint64_t)one->dropbehind<<20;
+config.readahead=(one->readahead>1024)?(1<<30):(one->readahead<<20);
+if (init_range(&one->range,5+scan.counts.non0files + (one->chunks.num - 1) // maxentries: 1: superblock, scan.counts.non0files: 1 per file, 3: inodes, dirs, other tables, 1: 4k padding
+		+ ((one->isfragments)?scan.counts.non0files:0) // fragment blocks, at most 1 per file
+		+ scan.counts.extents, // sparse files, at most 1 per data extent
 		1+scan.counts.subdirs,
-		NUM_SUPERBLOCK_SQFS_MKFS+scan.counts.namelens, // maxnames: 96: superblock, >0 filenames and !iszero subdirs
-		scan.counts.maxdepth)) GOTOERROR;
+		scan.counts.maxdepth,
+		&config)) GOTOERROR;
 
 while (1) {
 	uint64_t stamp;
@@ -366,11 +488,25 @@ while (1) {
 
 if (options->isverbose) {
 	if (assemble.isbuilt) {
-		syslog(LOG_INFO,"[%s] byte sizes: { archive:%"PRIu64", files:%"PRIu64", squashfs:%u, 4kpad:%u, gzip:%u }",
+		syslog(LOG_INFO,"[%s] byte sizes: { archive:%"PRIu64", files:%"PRIu64", squashfs:%u, inodes:%u, 4kpad:%u, gzip:%u }",
 				one->name,
 				assemble.stats.bytecounts.archive, assemble.stats.bytecounts.files,
-				assemble.stats.bytecounts.squashfs, assemble.stats.bytecounts.padding,
-				assemble.stats.bytecounts.bytessaved);
+				assemble.stats.bytecounts.squashfs, assemble.stats.bytecounts.inodetable,
+				assemble.stats.bytecounts.padding, assemble.stats.bytecounts.bytessaved);
+		syslog(LOG_INFO,"[%s] block size: %u%s",one->name,assemble.blocksize,(one->log_blocksize)?"":" (auto)");
+		if (one->iscompressdata) {
+			syslog(LOG_INFO,"[%s] data compression: { compressed:%u, reused:%u, raw:%u, saved:%"PRIu64" }",
+					one->name,one->store.stats.compressed,one->store.stats.reused,one->store.stats.raw,
+					one->store.stats.bytessaved);
+		}
+		if (one->isdedup) {
+			syslog(LOG_INFO,"[%s] dedup: { candidates:%u, files:%u, saved:%"PRIu64" }",
+					one->name,dedup.stats.candidates,dedup.stats.files,dedup.stats.bytessaved);
+		}
+		if (one->isfragments) {
+			syslog(LOG_INFO,"[%s] fragments: { files:%u, blocks:%u, compressed:%u }",
+					one->name,assemble.fragments.files,mkfs.fragmentlist.count,mkfs.stats.compressedfragments);
+		}
 	}
 }
 
@@ -379,18 +515,12 @@ one->stats.subdircount=scan.counts.subdirs;
 
 
 if (one->chunks.directory) {
+	if (one->iscompressdata) (void)sweep_store(&one->store);
 	deinit_assemble(&assemble); clear_assemble(&assemble);
 	deinit_temp_sqfs_mkfs(&mkfs); clear_temp_sqfs_mkfs(&mkfs);
 	deinit_scan(&scan); clear_scan(&scan);
 
-	if (clock_gettime(CLOCK_MONOTONIC_RAW,&end_time)) GOTOERROR;
-	{
-		unsigned int msec;
-		msec=(end_time.tv_sec-start_time.tv_sec)*1000;
-		if (end_time.tv_nsec >= start_time.tv_nsec) msec+=(end_time.tv_nsec-start_time.tv_nsec)/(1000*1000);
-		msec-=(start_time.tv_nsec-end_time.tv_nsec)/(1000*1000);
-		one->stats.msec_buildtime=msec;
-	}
+	if (msecsince(&one->stats.msec_buildtime,&start_time)) GOTOERROR;
 	if (options->isverbose) {
 		syslog(LOG_INFO,"Export %s (%u subdirs, %u files, %u msec).",
 			one->name,one->stats.subdircount,one->stats.filecount,one->stats.msec_buildtime);
@@ -408,6 +538,58 @@ error:
 	return -1;
 }
 
+struct lowpriority_export {
+	struct one_export *one;
+	struct options *options;
+	int r;
+};
+
+static void setpriority_export(struct one_export *one) {
+// nice and ioprio are per-thread on linux and new threads inherit them, so this covers scan and compress workers
+if (one->buildnice) {
+	int nice;
+	errno=0;
+	nice=getpriority(PRIO_PROCESS,0);
+	if (!errno) {
+		if (setpriority(PRIO_PROCESS,0,nice+one->buildnice)) {
+			syslog(LOG_ERR,"[%s] Unable to set buildnice (%s)",one->name,strerror(errno));
+		}
+	}
+}
+if (one->buildio) {
+	int ioprio;
+	ioprio=(one->buildio==IDLE_IOPRIO_EXPORT)?(IOPRIO_CLASS_IDLE<<IOPRIO_CLASS_SHIFT)
+			:((IOPRIO_CLASS_BE<<IOPRIO_CLASS_SHIFT)|7);
+	if (syscall(SYS_ioprio_set,IOPRIO_WHO_PROCESS,0,ioprio)) {
+		syslog(LOG_ERR,"[%s] Unable to set buildio (%s)",one->name,strerror(errno));
+	}
+}
+}
+
+static void *lowpriority_thread(void *arg) {
+struct lowpriority_export *lp=(struct lowpriority_export*)arg;
+(void)setpriority_export(lp->one);
+lp->r=buildexport(lp->one,lp->options);
+return NULL;
+}
+
+int build_one_export(struct one_export *one, struct options *options) {
+// check one->isbuilt before calling this
+// a lowered priority can't be raised again without privileges, so those builds get their own thread
+struct lowpriority_export lp;
+pthread_t thread;
+
+if (!one->buildnice && !one->buildio) return buildexport(one,options);
+lp.one=one;
+lp.options=options;
+lp.r=-1;
+if (pthread_create(&thread,NULL,lowpriority_thread,&lp)) GOTOERROR;
+(ignore)pthread_join(thread,NULL);
+return lp.r;
+error:
+	return -1;
+}
+
 #define getu64(a) *(uint64_t*)(a)
 static inline int isiniprange6(struct iprange6_export *iprange6, unsigned char *ipv6) {
 uint64_t high,low;
@@ -545,18 +727,141 @@ for (one=all->exports.first;one;one=one->next) {
 return NULL;
 }
 
-int preload_export(struct all_export *exports, struct options *options) {
+struct preload_export {
+	pthread_mutex_t mutex;
+	struct one_export *next; // the next export to consider, a thread owns an export once it's past it
+	struct options *options;
+	struct timespec start_time;
+	unsigned int pending,built,failed;
+	unsigned int numthreads;
+	pthread_t threads[MAXTHREADS_PRELOAD];
+};
+
+static void *preload_thread(void *arg) {
+struct preload_export *p=(struct preload_export*)arg;
+(ignore)pthread_mutex_lock(&p->mutex);
+while (p->next) {
+	struct one_export *one;
+	int r;
+	one=p->next;
+	p->next=one->next;
+	if (!one->ispending) continue;
+	(ignore)pthread_mutex_unlock(&p->mutex);
+	r=build_one_export(one,p->options);
+	if (r) syslog(LOG_ERR,"Error building export %s",one->name);
+	else syslog(LOG_INFO,"Preloaded export %s in %u msec",one->name,one->stats.msec_buildtime);
+	(ignore)pthread_mutex_lock(&p->mutex);
+	if (r) {
+		one->isdisabled=1;
+		p->failed+=1;
+	} else p->built+=1;
+	one->ispending=0;
+	p->pending-=1;
+	if (!p->pending) {
+		unsigned int msec;
+		if (!msecsince(&msec,&p->start_time)) {
+			syslog(LOG_INFO,"Preloaded %u export%s in %u msec (%u thread%s)",
+					p->built,(p->built==1)?"":"s",msec,p->numthreads,(p->numthreads==1)?"":"s");
+		}
+	}
+}
+(ignore)pthread_mutex_unlock(&p->mutex);
+return NULL;
+}
+
+int startpreload_export(struct all_export *exports, struct options *options) {
+// exports are independent so they're built side by side, ispending_export() says which aren't ready yet
+struct preload_export *p=NULL;
 struct one_export *one;
+unsigned int numthreads,count=0,ui;
+
 for (one=exports->exports.first;one;one=one->next) {
 	if (!one->ispreload) continue;
 	if (one->isbuilt) continue;
-	if (build_one_export(one,options)) GOTOERROR;
+	one->ispending=1;
+	count+=1;
+}
+if (!count) return 0;
+
+numthreads=exports->config.preloadthreads;
+if (!numthreads) {
+	long l;
+	l=sysconf(_SC_NPROCESSORS_ONLN);
+	numthreads=(l>0)?(unsigned int)l:1;
+}
+if (numthreads>MAXTHREADS_PRELOAD) numthreads=MAXTHREADS_PRELOAD;
+if (numthreads>count) numthreads=count;
+
+if (!(p=ZTMALLOC(1,struct preload_export))) GOTOERROR;
+if (pthread_mutex_init(&p->mutex,NULL)) { free(p); GOTOERROR; }
+exports->preload=p;
+p->next=exports->exports.first;
+p->options=options;
+p->pending=count;
+if (clock_gettime(CLOCK_MONOTONIC_RAW,&p->start_time)) GOTOERROR;
+(ignore)pthread_mutex_lock(&p->mutex); // numthreads is logged by the last builder
+for (ui=0;ui<numthreads;ui++) {
+	if (pthread_create(&p->threads[ui],NULL,preload_thread,p)) break;
+	p->numthreads+=1;
+}
+(ignore)pthread_mutex_unlock(&p->mutex);
+if (!p->numthreads) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+int waitpreload_export(struct all_export *exports) {
+// returns -1 if any export failed to build
+struct preload_export *p=exports->preload;
+unsigned int ui;
+int r=0;
+if (!p) return 0;
+for (ui=0;ui<p->numthreads;ui++) (ignore)pthread_join(p->threads[ui],NULL);
+if (p->failed || p->pending) r=-1;
+(ignore)pthread_mutex_destroy(&p->mutex);
+free(p);
+exports->preload=NULL;
+return r;
+}
+
+void reappreload_export(struct all_export *exports) {
+// joins the builders once they're all done, so children forked later don't inherit them
+struct preload_export *p=exports->preload;
+unsigned int pending;
+if (!p) return;
+(ignore)pthread_mutex_lock(&p->mutex);
+pending=p->pending;
+(ignore)pthread_mutex_unlock(&p->mutex);
+if (!pending) (ignore)waitpreload_export(exports);
 }
+
+int preload_export(struct all_export *exports, struct options *options) {
+if (startpreload_export(exports,options)) GOTOERROR;
+if (waitpreload_export(exports)) GOTOERROR;
 return 0;
 error:
+	(ignore)waitpreload_export(exports);
 	return -1;
 }
 
+int ispending_export(struct all_export *exports, struct one_export *one) {
+int r;
+if (!exports->preload) return 0;
+(ignore)pthread_mutex_lock(&exports->preload->mutex);
+r=one->ispending;
+(ignore)pthread_mutex_unlock(&exports->preload->mutex);
+return r;
+}
+
+// holding this across fork() gives the child a consistent view of what's built
+void lockpreload_export(struct all_export *exports) {
+if (exports->preload) (ignore)pthread_mutex_lock(&exports->preload->mutex);
+}
+void unlockpreload_export(struct all_export *exports) {
+if (exports->preload) (ignore)pthread_mutex_unlock(&exports->preload->mutex);
+}
+
 int rebuild_one_export(struct one_export *one, struct options *options) {
 (void)reset_range(&one->range);
 one->isdisabled=0;
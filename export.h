@@ -42,6 +42,9 @@ struct key_export {
 	struct key_export *next;
 };
 
+#define LOW_IOPRIO_EXPORT		1 // best-effort class, lowest level
+#define IDLE_IOPRIO_EXPORT	2 // only gets disk time when nothing else wants it
+
 #define DIR_TYPE_CHUNK_EXPORT			1
 #define FILE_TYPE_CHUNK_EXPORT		2
 #define PADTO4K_TYPE_CHUNK_EXPORT	3
@@ -65,8 +68,26 @@ struct one_export {
 	int iskeyrequired:1;
 	int istlsrequired:1;
 	int isbuilt:1;
-	unsigned int gziplevel:4;
+	int iscompressdata:1;
+	int isfragments:1; // pack small files and tails into shared blocks
+	int isdedup:1; // files with identical contents share data
+	int isexporttable:1; // inode lookup table, for nfs
+	unsigned int gziplevel:4; // 0 => nothing is compressed, whatever the compressor
+	int ispending; // a background preload hasn't finished, not a bitfield as it's shared with the builder
+	unsigned int compressor; // _ID_COMPRESS
+	unsigned int compresslevel; // 0 => the compressor's default, gziplevel for gzip
+	unsigned int log_blocksize; // 12..20, 0 => auto
 	unsigned int maxfiles;
+	unsigned int mmapwindow; // in MB, 0 => map whole files
+	unsigned int dropbehind; // in MB, 0 => off
+	unsigned int readahead; // in MB, 0 => off
+	unsigned int compressthreads; // 0 => one per cpu
+	unsigned int scanthreads; // 0 => one per cpu
+	char *compresscache; // directory for compressed data, NULL => keep it in memory
+	char *spilldir; // directory for the build's scan data, NULL => keep it in memory
+	int buildnice; // added to the server's nice for builds
+	unsigned int buildio; // _IOPRIO_EXPORT, 0 => unchanged
+	unsigned int buildrate; // directory entries per second while scanning, 0 => unlimited
 	uint32_t id; // starts at 1
 	char *name;
 	uint64_t timestamp; // time of build
@@ -92,6 +113,7 @@ struct one_export {
 		unsigned int subdircount;
 	} stats;
 	struct range range;
+	struct store store; // compressed data blocks, this outlives builds
 
 	struct one_export *next;
 };
@@ -100,6 +122,7 @@ struct all_export {
 	struct {
 		int istlsrequired:1; // this effectively is a default
 		unsigned int shorttimeout; // this does double-duty as a default
+		unsigned int preloadthreads; // 0 => one per cpu
 		uid_t uid;
 		gid_t gid;
 	} config;
@@ -111,8 +134,25 @@ struct all_export {
 		int iskeepalive:1;
 		int islisted:1;
 		int iskeyrequired:1;
+		int iscompressdata:1;
+		int isfragments:1;
+		int isdedup:1;
+		int isexporttable:1;
 		unsigned int gziplevel:4;
+		unsigned int compressor;
+		unsigned int compresslevel;
+		unsigned int log_blocksize;
 		unsigned int maxfiles;
+		unsigned int mmapwindow;
+		unsigned int dropbehind;
+		unsigned int readahead;
+		unsigned int compressthreads;
+		unsigned int scanthreads;
+		char *compresscache;
+		char *spilldir;
+		int buildnice;
+		unsigned int buildio;
+		unsigned int buildrate;
 	} defaults;
 	struct {
 		unsigned int count;
@@ -128,6 +168,7 @@ struct all_export {
 	struct {
 		struct blockmem blockmem;
 	} tofree;
+	struct preload_export *preload; // background builds, NULL if none were started
 };
 
 int init_all_export(struct all_export *all);
@@ -145,6 +186,12 @@ struct one_export *ipv6_findany_export(struct all_export *all, unsigned char *ip
 int text_allowhost_add_one_export(struct all_export *all, struct one_export *one, char *text, int isonlyiftls);
 int text_allowhost_add_export(struct all_export *all, char *text, int isonlyiftls);
 int preload_export(struct all_export *exports, struct options *options);
+int startpreload_export(struct all_export *exports, struct options *options);
+int waitpreload_export(struct all_export *exports);
+void reappreload_export(struct all_export *exports);
+int ispending_export(struct all_export *exports, struct one_export *one);
+void lockpreload_export(struct all_export *exports);
+void unlockpreload_export(struct all_export *exports);
 int isallowed_export(struct one_export *one, unsigned char *ip, int isipv4);
 int overlay_add_export(struct all_export *exports, char *str, int israw, struct options *options);
 int overlay_add_one_export(struct all_export *exports, struct one_export *one, char *str, int israw, struct options *options);
@@ -42,12 +42,15 @@
 #include "common/mapmem.h"
 #include "common/blockmem.h"
 #include "common/unixaf.h"
+#include "common/fileio.h"
 #include "misc.h"
 #include "options.h"
 #include "scan.h"
+#include "compress.h"
 #include "mkfs.h"
 #include "range.h"
 #include "assemble.h"
+#include "store.h"
 #include "tcpsocket.h"
 #include "export.h"
 #include "nbd.h"
@@ -101,6 +104,21 @@ if (*str=='1') return 1;
 return 0;
 }
 
+static unsigned int logblocksize(char *str) {
+// size in KB or "auto", rounds down to a power of 2 in 4..1024
+unsigned int kb,l=12;
+if (!strncasecmp(str,"auto",4)) return 0;
+kb=atoi(str);
+while ((l<20) && ((1u<<(l-9))<=kb)) l++;
+return l;
+}
+
+static unsigned int buildio(char *str) {
+if (!strncasecmp(str,"idle",4)) return IDLE_IOPRIO_EXPORT;
+if (!strncasecmp(str,"low",3)) return LOW_IOPRIO_EXPORT;
+return 0;
+}
+
 static int loadconfigfile3(struct all_export *exports, struct options *options, struct one_export *one,
 		char *start, char *end, int lineno) {
 char *tart=start+1;
@@ -112,11 +130,30 @@ if (one) {
 			if (!strncmp(tart,"llownet",7)){f=1;if(text_allowhost_add_one_export(exports,one,end,0))GOTOERROR;}
 			else if (!strncmp(tart,"llowtlsnet",10)){f=1;if(text_allowhost_add_one_export(exports,one,end,1))GOTOERROR;}
 			break;
+		case 'b':
+			if (!strncmp(tart,"locksize",8)) { f=1; one->log_blocksize=logblocksize(end); }
+			else if (!strncmp(tart,"uildnice",8)) { f=1; one->buildnice=atoi(end); }
+			else if (!strncmp(tart,"uildio",6)) { f=1; one->buildio=buildio(end); }
+			else if (!strncmp(tart,"uildrate",8)) { f=1; one->buildrate=atoi(end); }
+			break;
+		case 'c':
+			if (!strncmp(tart,"ompressdata",11)) { f=1; one->iscompressdata=isyes(end); }
+			else if (!strncmp(tart,"ompresscache",12)) { f=1; if (setfilename_export(&one->compresscache,exports,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ompressor",9)) { f=1; if (parse_compress(&one->compressor,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ompresslevel",12)) { f=1; one->compresslevel=atoi(end); }
+			else if (!strncmp(tart,"ompressthreads",14)) { f=1; one->compressthreads=atoi(end); }
+			break;
 		case 'd':
 			if (!strncmp(tart,"enyall",6)) { f=1; one->isdenydefault=isyes(end); }
+			else if (!strncmp(tart,"edup",4)) { f=1; one->isdedup=isyes(end); }
 			else if (!strncmp(tart,"irectory",8)) {f=1;if (directoryname_set_export(exports,one,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ropbehind",9)) { f=1; one->dropbehind=atoi(end); }
+			break;
+		case 'e': if (!strncmp(tart,"xporttable",10)) { f=1; one->isexporttable=isyes(end); } break;
+		case 'f':
+			if (!strncmp(tart,"ilename_ro",10)) {f=1;if(filename_set_export(exports,one,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ragments",8)) { f=1; one->isfragments=isyes(end); }
 			break;
-		case 'f': if (!strncmp(tart,"ilename_ro",10)) {f=1;if(filename_set_export(exports,one,end)) GOTOERROR; } break;
 		case 'g': if (!strncmp(tart,"ziplevel",8)) { f=1; one->gziplevel=atoi(end) % 10; } break;
 		case 'k':
 			if (!strncmp(tart,"eypermit",8)) { f=1; if (key_add_one_export(exports,one,end)) GOTOERROR; }
@@ -127,15 +164,23 @@ if (one) {
 			if (!strncmp(tart,"ongtimeout",10)) { f=1; one->longtimeout=atoi(end); }
 			else if (!strncmp(tart,"isted",5)) { f=1; one->islisted=isyes(end); }
 			break;
-		case 'm': if (!strncmp(tart,"axfiles",7)) { f=1; one->maxfiles=atoi(end); } break;
+		case 'm':
+			if (!strncmp(tart,"axfiles",7)) { f=1; one->maxfiles=atoi(end); }
+			else if (!strncmp(tart,"mapwindow",9)) { f=1; one->mmapwindow=atoi(end); }
+			break;
 		case 'n': if (!strncmp(tart,"odelay",6)) { f=1; one->isnodelay=isyes(end); } break;
-		case 's': if (!strncmp(tart,"horttimeout",11)) { f=1; one->shorttimeout=atoi(end); } break;
+		case 's':
+			if (!strncmp(tart,"horttimeout",11)) { f=1; one->shorttimeout=atoi(end); }
+			else if (!strncmp(tart,"canthreads",10)) { f=1; one->scanthreads=atoi(end); }
+			else if (!strncmp(tart,"pilldir",7)) { f=1; if (setfilename_export(&one->spilldir,exports,end)) GOTOERROR; }
+			break;
 		case 't': if (!strncmp(tart,"lsrequired",10)) { f=1; one->istlsrequired=isyes(end); } break;
 		case 'o':
 			if (!strncmp(tart,"verlayraw",9)){f=1;if(overlay_add_one_export(exports,one,end,1,options))GOTOERROR;}
 			else if (!strncmp(tart,"verlay",6)){f=1;if(overlay_add_one_export(exports,one,end,0,options))GOTOERROR;}
 			break;
 		case 'p': if (!strncmp(tart,"reload",6)) { f=1; one->ispreload=isyes(end); } break;
+		case 'r': if (!strncmp(tart,"eadahead",8)) { f=1; one->readahead=atoi(end); } break;
 	}
 } else { // global
 	switch (*start) {
@@ -144,12 +189,29 @@ if (one) {
 			else if (!strncmp(tart,"llowtlsnet",10)) { f=1; if (text_allowhost_add_export(exports,end,1)) GOTOERROR; }
 			else if (!strncmp(tart,"llowreset",9)) { f=1; if (isyes(end) && text_allowhost_add_export(exports,NULL,0)) GOTOERROR; }
 			break;
-		case 'b': if (!strncmp(tart,"ackground",9)) { f=1; options->isnofork=(isyes(end))?0:1; } break;
-		case 'c': if (!strncmp(tart,"lientmax",8)) { f=1; options->maxchildren=atoi(end); } break;
+		case 'b':
+			if (!strncmp(tart,"ackground",9)) { f=1; options->isnofork=(isyes(end))?0:1; }
+			else if (!strncmp(tart,"locksize",8)) { f=1; exports->defaults.log_blocksize=logblocksize(end); }
+			else if (!strncmp(tart,"uildnice",8)) { f=1; exports->defaults.buildnice=atoi(end); }
+			else if (!strncmp(tart,"uildio",6)) { f=1; exports->defaults.buildio=buildio(end); }
+			else if (!strncmp(tart,"uildrate",8)) { f=1; exports->defaults.buildrate=atoi(end); }
+			break;
+		case 'c':
+			if (!strncmp(tart,"lientmax",8)) { f=1; options->maxchildren=atoi(end); }
+			else if (!strncmp(tart,"ompressdata",11)) { f=1; exports->defaults.iscompressdata=isyes(end); }
+			else if (!strncmp(tart,"ompresscache",12)) { f=1; if (setfilename_export(&exports->defaults.compresscache,exports,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ompressor",9)) { f=1; if (parse_compress(&exports->defaults.compressor,end)) GOTOERROR; }
+			else if (!strncmp(tart,"ompresslevel",12)) { f=1; exports->defaults.compresslevel=atoi(end); }
+			else if (!strncmp(tart,"ompressthreads",14)) { f=1; exports->defaults.compressthreads=atoi(end); }
+			break;
 		case 'd': // note that (isdebug=>syslog to stderr) only happens with cmdline "-d" and not with "debug=yes"
 			if (!strncmp(tart,"ebug",4)) { f=1; options->isdebug=isyes(end); }
 			else if (!strncmp(tart,"enyall",6)) { f=1; exports->defaults.isdenydefault=isyes(end); }
+			else if (!strncmp(tart,"edup",4)) { f=1; exports->defaults.isdedup=isyes(end); }
+			else if (!strncmp(tart,"ropbehind",9)) { f=1; exports->defaults.dropbehind=atoi(end); }
 			break;
+		case 'e': if (!strncmp(tart,"xporttable",10)) { f=1; exports->defaults.isexporttable=isyes(end); } break;
+		case 'f': if (!strncmp(tart,"ragments",8)) { f=1; exports->defaults.isfragments=isyes(end); } break;
 		case 'g':
 			if (!strncmp(tart,"roup",4)) { f=1; if (getgid_misc(&exports->config.gid,end)) GOTOERROR; }
 			else if (!strncmp(tart,"ziplevel",8)) { f=1; exports->defaults.gziplevel=atoi(end) % 10; }
@@ -164,7 +226,10 @@ if (one) {
 			if (!strncmp(tart,"ongtimeout",10)) { f=1; exports->defaults.longtimeout=atoi(end); }
 			else if (!strncmp(tart,"isted",5)) { f=1; exports->defaults.islisted=isyes(end); }
 			break;
-		case 'm':if (!strncmp(tart,"axfiles",7)) { f=1; exports->defaults.maxfiles=atoi(end); } break;
+		case 'm':
+			if (!strncmp(tart,"axfiles",7)) { f=1; exports->defaults.maxfiles=atoi(end); }
+			else if (!strncmp(tart,"mapwindow",9)) { f=1; exports->defaults.mmapwindow=atoi(end); }
+			break;
 		case 'n': if (!strncmp(tart,"odelay",6)) { f=1; exports->defaults.isnodelay=isyes(end); } break;
 		case 'o': 
 			if (!strncmp(tart,"verlayreset",11)) { f=1; if (isyes(end) && overlay_add_export(exports,NULL,0,options)) GOTOERROR; }
@@ -175,9 +240,15 @@ if (one) {
 			if (!strncmp(tart,"ortsearch",9)) { f=1; options->portsearch=atoi(end); }
 			else if (!strncmp(tart,"ortwait",7)) { f=1; options->portwait=atoi(end); }
 			else if (!strncmp(tart,"ort",3)) { f=1; options->tcpport=atoi(end); }
+			else if (!strncmp(tart,"reloadthreads",13)) { f=1; exports->config.preloadthreads=atoi(end); }
 			else if (!strncmp(tart,"reload",6)) { f=1; exports->defaults.ispreload=isyes(end); }
 			break;
-		case 's': if (!strncmp(tart,"horttimeout",11)) { f=1; exports->config.shorttimeout=atoi(end); } break;
+		case 'r': if (!strncmp(tart,"eadahead",8)) { f=1; exports->defaults.readahead=atoi(end); } break;
+		case 's':
+			if (!strncmp(tart,"horttimeout",11)) { f=1; exports->config.shorttimeout=atoi(end); }
+			else if (!strncmp(tart,"canthreads",10)) { f=1; exports->defaults.scanthreads=atoi(end); }
+			else if (!strncmp(tart,"pilldir",7)) { f=1; if (setfilename_export(&exports->defaults.spilldir,exports,end)) GOTOERROR; }
+			break;
 		case 't':
 			if (!strncmp(tart,"rackclients",11)) { f=1; options->issetenv=isyes(end); }
 			else if (!strncmp(tart,"lsrequired",10)) { f=1; exports->config.istlsrequired=isyes(end); }
@@ -339,7 +410,9 @@ switch (message[0]) {
 	case 'R':
 		memcpy(&u32,message+4,sizeof(uint32_t));
 		one=findbyid_one_export(exports,u32);
-		if (one) {
+		if (one && ispending_export(exports,one)) {
+			syslog(LOG_INFO,"Ignoring rebuild of export %s, it's still building",one->name);
+		} else if (one) {
 			if (rebuild_one_export(one,options)) GOTOERROR;
 			if (one->isdisabled) syslog(LOG_ERR,"Error rebuilding export %s",one->name);
 		}
@@ -379,6 +452,7 @@ if (options.ishelp) return print_help();
 if (options.islist) return print_runninglist();
 
 (void)openlog(NULL,(options.isdebug)?LOG_PERROR|LOG_PID:LOG_PID,(options.isnofork)?LOG_USER:LOG_DAEMON);
+if (forksafe_syslog_misc()) GOTOERROR;
 
 signal(SIGPIPE,SIG_IGN);
 signal(SIGCHLD,sigchld_handler);
@@ -415,9 +489,11 @@ if (!all_export.exports.first) {
 		}
 	}
 
-	if (preload_export(&all_export,&options)) { // we could do this before setuid but that just delays any problem
-		syslog(LOG_ERR,"Error building preloads");
-		GOTOERROR;
+	if (options.isnofork) { // clients are served in this process, so preloads have to finish first
+		if (preload_export(&all_export,&options)) { // we could do this before setuid but that just delays any problem
+			syslog(LOG_ERR,"Error building preloads");
+			GOTOERROR;
+		}
 	}
 	syslog(LOG_INFO,"Waiting on port %u",tcpsocket.port);
 
@@ -427,6 +503,11 @@ if (!all_export.exports.first) {
 		signal(SIGHUP,SIG_IGN);
 		if (socketpair(AF_UNIX,SOCK_STREAM,0,controlsockets)) GOTOERROR;
 		if (controlsockets[1]	> maxfdp1) maxfdp1=controlsockets[1];
+		// threads don't survive daemon(), preloads build while we serve what's ready
+		if (startpreload_export(&all_export,&options)) {
+			syslog(LOG_ERR,"Error starting preloads");
+			GOTOERROR;
+		}
 	}
 	maxfdp1+=1;
 	while (1) {
@@ -472,7 +553,10 @@ if (!all_export.exports.first) {
 
 		if (!options.isnofork) {
 			pid_t pid;
+			(void)reappreload_export(&all_export);
+			(void)lockpreload_export(&all_export);
 			pid=fork();
+			(void)unlockpreload_export(&all_export);
 			if (pid) { numchildren_global+=1; close(client.fd); if (pid<0) sleep(1); continue; }
 			(void)closelog();
 			(void)openlog(NULL,(options.isdebug)?LOG_PERROR|LOG_PID:LOG_PID,LOG_DAEMON);
@@ -27,6 +27,8 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -37,6 +39,34 @@
 
 #include "misc.h"
 
+// glibc's syslog lock survives fork() as it was, a child forked while another thread is logging
+// hangs on its first syslog(). The Makefile links with --wrap=syslog so every call comes through here.
+static pthread_mutex_t syslogmutex_misc=PTHREAD_MUTEX_INITIALIZER;
+
+void __wrap_syslog(int priority, const char *format, ...) {
+va_list ap;
+(ignore)pthread_mutex_lock(&syslogmutex_misc);
+va_start(ap,format);
+vsyslog(priority,format,ap);
+va_end(ap);
+(ignore)pthread_mutex_unlock(&syslogmutex_misc);
+}
+
+static void locksyslog(void) {
+(ignore)pthread_mutex_lock(&syslogmutex_misc);
+}
+static void unlocksyslog(void) {
+(ignore)pthread_mutex_unlock(&syslogmutex_misc);
+}
+
+int forksafe_syslog_misc(void) {
+// call this before starting threads that can outlive a fork()
+if (pthread_atfork(locksyslog,unlocksyslog,unlocksyslog)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
 int ismappedipv4_misc(unsigned char *ipv6) {
 unsigned char mapprefix[12]={0,0,0,0, 0,0,0,0, 0,0,255,255};
 if (!memcmp(ipv6,mapprefix,12)) return 1;
@@ -451,30 +481,3 @@ struct timeval tv;
 (ignore)gettimeofday(&tv,NULL);
 return (tv.tv_sec*1000)+(tv.tv_usec/1000);
 }
-
-int writen(int fd, unsigned char *msg, unsigned int len) {
-while (len) {
-	ssize_t k;
-	k=write(fd,(char *)msg,len);
-	if (k<1) {
-		if ((k<0) && (errno==EINTR)) continue;
-		return -1;
-	}
-	len-=k;
-	msg+=k;
-}
-return 0;
-}
-int readn(int fd, unsigned char *msg, unsigned int len) {
-while (len) {
-	ssize_t k;
-	k=read(fd,(char *)msg,len);
-	if (k<1) {
-		if ((k<0) && (errno==EINTR)) continue;
-		return -1;
-	}
-	len-=k;
-	msg+=k;
-}
-return 0;
-}
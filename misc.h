@@ -32,6 +32,5 @@ int getsize2_blockdevice(uint64_t *size_out, int fd);
 int getuid_misc(uid_t *uid_out, char *user);
 int getgid_misc(gid_t *gid_out, char *group);
 uint64_t msecstamp(void);
+int forksafe_syslog_misc(void);
 #define msleep(a) usleep((a)*1000)
-int writen(int fd, unsigned char *msg, unsigned int len);
-int readn(int fd, unsigned char *msg, unsigned int len);
@@ -24,202 +24,447 @@
 #include <stdint.h>
 #include <endian.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <zlib.h>
 #include "common/conventions.h"
 #include "common/mapmem.h"
 #include "options.h"
 #include "scan.h"
+#include "compress.h"
+#include "store.h"
 
 #include "mkfs.h"
 
 #define SIZE_METABLOCK	8192
+#define MAXTHREADS_MKFS	64
+#define MINPLACES_MKFS	64
+#define MINIMAGE_MKFS	(1<<16)
+
+// full metablocks are sealed and compressed by a pool of workers while the tables are still being written
+// refs into other tables are written as metablock indices with a patch, and the patch is applied once
+// the metablocks before the target are compressed, those were all sealed earlier so sealing order always works
+// placed metablocks are appended to their table's .image, which goes into range as-is, and are then reused
+
+struct worker_mkfs {
+	pthread_t thread;
+	struct pool_mkfs *pool;
+	struct compress compressor;
+	unsigned char *spareblock;
+};
+
+struct pool_mkfs {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct metablock_mkfs *first,*last; // sealed, waiting for a worker
+	unsigned int pending; // sealed and not yet placed
+	unsigned int bytessaved; // added to temp's stats when the pool is drained
+	struct temp_sqfs_mkfs *temp;
+	int isdone; // no more metablocks are coming
+	int iserror;
+	unsigned int numthreads,started;
+	struct worker_mkfs *workers;
+};
 
-static struct metablock_mkfs *new_metablock(struct mapmem *mm, unsigned int size) {
+static struct metablock_mkfs *new_metablock(struct temp_sqfs_mkfs *temp, struct table_mkfs *table, unsigned int index) {
+struct pool_mkfs *pool=temp->compress.pool;
 struct metablock_mkfs *metablock;
-if (!(metablock=alloc_mapmem(mm,size+sizeof(struct metablock_mkfs)))) GOTOERROR;
+if (pool) (ignore)pthread_mutex_lock(&pool->mutex);
+metablock=temp->spares;
+if (metablock) temp->spares=metablock->next;
+if (pool) (ignore)pthread_mutex_unlock(&pool->mutex);
+if (!metablock) {
+	if (!(metablock=alloc_mapmem(temp->mm,SIZE_METABLOCK+sizeof(struct metablock_mkfs)))) GOTOERROR;
+}
 metablock->compressedsize=0;
+metablock->fill=0;
+metablock->index=index;
+metablock->table=table;
 metablock->data=(unsigned char *)metablock+sizeof(struct metablock_mkfs);
+metablock->patches=NULL;
 metablock->next=NULL;
 return metablock;
 error:
 	return NULL;
 }
 
-static int init_table(struct table_mkfs *t, struct mapmem *mm) {
-if (!(t->first=t->current=new_metablock(mm,SIZE_METABLOCK))) GOTOERROR;
+static int init_table(struct temp_sqfs_mkfs *temp, struct table_mkfs *t) {
+if (!(t->current=new_metablock(temp,t,0))) GOTOERROR;
 t->blockleft=SIZE_METABLOCK;
+if (!(t->places.list=ZTMALLOC(MINPLACES_MKFS,struct place_mkfs))) GOTOERROR;
+t->places.max=MINPLACES_MKFS;
 return 0;
 error:
 	return -1;
 }
 
-static void *zalloc(void *mm_in, unsigned int count, unsigned int size) {
-struct mapmem *mm=(struct mapmem*)mm_in;
-// fprintf(stderr,"%s:%d %s allocating %u (%u * %u) bytes\n",__FILE__,__LINE__,__FUNCTION__,count*size,count,size);
-return alloc_mapmem(mm,count*size); // TODO think about alignment
+static int compressblock(unsigned int *saved_out, struct compress *compressor, unsigned char *spareblock,
+		struct metablock_mkfs *mb) {
+unsigned int csize;
+
+*saved_out=0;
+if (mb->fill<2) return 0;
+if (block_compress(&csize,compressor,spareblock,mb->fill-1,mb->data,mb->fill)) GOTOERROR;
+if (csize) { // successful compression
+	mb->compressedsize=csize;
+// fprintf(stderr,"%s:%d Successful compression, %u -> %u\n",__FILE__,__LINE__,mb->fill,csize);
+	*saved_out=mb->fill-csize;
+	memcpy(mb->data,spareblock,csize);
 }
-static void zfree(void *mm_in, void *ptr) {
-// gzip allocates about 256k, it'll be freed when mapmem unmaps, after assemble
-// fprintf(stderr,"%s:%d %s %p\n",__FILE__,__LINE__,__FUNCTION__,ptr);
+return 0;
+error:
+	return -1;
 }
 
-int init_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s, struct mapmem *mm, unsigned int blocksize, unsigned int gziplevel) {
-s->mm=mm;
-s->config.blocksize=blocksize;
-if (init_table(&s->inode_table,mm)) GOTOERROR;
-if (init_table(&s->directory_table,mm)) GOTOERROR;
-if (init_table(&s->idblock_table,mm)) GOTOERROR;
-if (gziplevel) {
-	if (!(s->compress.spareblock=alloc_mapmem(mm,SIZE_METABLOCK))) GOTOERROR;
-	s->compress.zstream.zalloc=zalloc;
-	s->compress.zstream.zfree=zfree;
-	s->compress.zstream.opaque=(void *)mm;
-	if (Z_OK!=deflateInit(&s->compress.zstream,gziplevel)) {
-		s->compress.zstream.opaque=NULL;
-		GOTOERROR; // could also disable gzip and ignore error
+static int isready(struct metablock_mkfs *mb) {
+// every metablock a patch points to has a known offset
+struct patch_mkfs *p;
+for (p=mb->patches;p;p=p->next) {
+	if (p->block>p->target->places.count) return 0;
+}
+return 1;
+}
+
+static void applypatches(struct metablock_mkfs *mb) {
+struct patch_mkfs *p;
+for (p=mb->patches;p;p=p->next) {
+	unsigned char buff4[4];
+	int i;
+	*(uint32_t*)buff4=htole32(p->target->places.list[p->block].start);
+	for (i=0;i<4;i++) {
+		int64_t k=p->position+i;
+		if ((k>=0) && (k<mb->fill)) mb->data[k]=buff4[i]; // a u32 can straddle metablocks
 	}
 }
+}
+
+static int appendimage(struct table_mkfs *table, struct metablock_mkfs *mb) {
+unsigned int len;
+unsigned short header;
+if (mb->compressedsize) {
+	len=mb->compressedsize;
+	header=len;
+} else {
+	len=mb->fill;
+	header=32768|len;
+}
+if (table->image.len+2+len>table->image.max) {
+	unsigned char *data;
+	unsigned int max=table->image.max*2;
+	if (max<MINIMAGE_MKFS) max=MINIMAGE_MKFS;
+	if (!(data=realloc(table->image.data,max))) GOTOERROR;
+	table->image.data=data;
+	table->image.max=max;
+}
+*(uint16_t*)(table->image.data+table->image.len)=htole16(header);
+memcpy(table->image.data+table->image.len+2,mb->data,len);
+table->image.len+=2+len;
 return 0;
 error:
 	return -1;
 }
-#if 0
-void deinit_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s) {
-if (s->compress.zstream.opaque) {
-//	(ignore)deflateEnd(&s->compress.zstream); // there's no need for this as it doesn't free anything anyway
+
+static int place(struct temp_sqfs_mkfs *temp, struct metablock_mkfs *mb) {
+// mb is compressed (or not worth it), this advances the known offsets and moves what it can to .image
+struct table_mkfs *table=mb->table;
+struct place_mkfs *list=table->places.list;
+int iserror=0;
+list[mb->index].size=2+((mb->compressedsize)?mb->compressedsize:mb->fill);
+list[mb->index].metablock=mb;
+while (list[table->places.count].size) { // offsets advance even after an error, others may be waiting on them
+	struct place_mkfs *pl=&list[table->places.count];
+	if (appendimage(table,pl->metablock)) iserror=1;
+	pl->metablock->next=temp->spares;
+	temp->spares=pl->metablock;
+	pl->metablock=NULL;
+	list[table->places.count+1].start=pl->start+pl->size;
+	table->places.count+=1;
 }
+if (iserror) GOTOERROR;
+return 0;
+error:
+	return -1;
 }
-#endif
-
-static int compress_metablock(struct temp_sqfs_mkfs *temp, struct metablock_mkfs *current, unsigned int blockfill) {
-struct z_stream_s *zs;
-int isworthit=0;
 
-zs=&temp->compress.zstream;
-
-zs->next_in=current->data;
-zs->avail_in=blockfill;
-zs->next_out=temp->compress.spareblock;
-zs->avail_out=SIZE_METABLOCK;
-zs->total_out=0; // is this necessary? it isn't 0d by deflateReset
+static void *worker_thread(void *arg) {
+struct worker_mkfs *w=(struct worker_mkfs*)arg;
+struct pool_mkfs *pool=w->pool;
+(ignore)pthread_mutex_lock(&pool->mutex);
+while (1) {
+	struct metablock_mkfs *mb;
+	unsigned int saved;
+	int r;
+	if (!pool->first) {
+		if (pool->isdone) break;
+		(ignore)pthread_cond_wait(&pool->cond,&pool->mutex);
+		continue;
+	}
+	mb=pool->first;
+	pool->first=mb->next;
+	if (!pool->first) pool->last=NULL;
+	while (!isready(mb)) (ignore)pthread_cond_wait(&pool->cond,&pool->mutex); // earlier metablocks are with other workers
+	(void)applypatches(mb);
+	(ignore)pthread_mutex_unlock(&pool->mutex);
+	r=compressblock(&saved,&w->compressor,w->spareblock,mb);
+	(ignore)pthread_mutex_lock(&pool->mutex);
+	if (r) pool->iserror=1; // mb is left uncompressed so later ones still get placed
+	pool->bytessaved+=saved;
+	if (place(pool->temp,mb)) pool->iserror=1;
+	pool->pending-=1;
+	(ignore)pthread_cond_broadcast(&pool->cond);
+}
+(ignore)pthread_mutex_unlock(&pool->mutex);
+return NULL;
+}
 
-switch (deflate(zs,Z_FINISH)) {
-	case Z_STREAM_END: // successful compression
-		if (zs->total_out<blockfill) isworthit=1;
-		break;
-	case Z_BUF_ERROR: break;
-	default: GOTOERROR;
+static void stoppool(struct pool_mkfs *pool) {
+unsigned int ui;
+(ignore)pthread_mutex_lock(&pool->mutex);
+pool->isdone=1;
+(ignore)pthread_cond_broadcast(&pool->cond);
+(ignore)pthread_mutex_unlock(&pool->mutex);
+for (ui=0;ui<pool->started;ui++) (ignore)pthread_join(pool->workers[ui].thread,NULL);
+if (pool->workers) {
+	for (ui=0;ui<pool->numthreads;ui++) {
+		(void)deinit_compress(&pool->workers[ui].compressor);
+		iffree(pool->workers[ui].spareblock);
+	}
+	free(pool->workers);
 }
-if (isworthit) {
-	current->compressedsize=zs->total_out;
-// fprintf(stderr,"%s:%d Successful gzip, %u -> %u\n",__FILE__,__LINE__blockfill,current->compressedsize);
-	temp->stats.bytessaved+=blockfill-current->compressedsize;
-	memcpy(current->data,temp->compress.spareblock,current->compressedsize);
+(ignore)pthread_cond_destroy(&pool->cond);
+(ignore)pthread_mutex_destroy(&pool->mutex);
+free(pool);
 }
 
-if (Z_OK!=deflateReset(zs)) GOTOERROR;
+static int startpool(struct temp_sqfs_mkfs *temp, struct config_compress *compress, unsigned int numthreads) {
+struct pool_mkfs *pool;
+unsigned int ui;
+
+if (!(pool=ZTMALLOC(1,struct pool_mkfs))) GOTOERROR;
+pool->temp=temp;
+pool->numthreads=numthreads;
+if (pthread_mutex_init(&pool->mutex,NULL)) { free(pool); GOTOERROR; }
+if (pthread_cond_init(&pool->cond,NULL)) { (ignore)pthread_mutex_destroy(&pool->mutex); free(pool); GOTOERROR; }
+temp->compress.pool=pool;
+if (!(pool->workers=ZTMALLOC(numthreads,struct worker_mkfs))) GOTOERROR;
+for (ui=0;ui<numthreads;ui++) {
+	struct worker_mkfs *w=&pool->workers[ui];
+	w->pool=pool;
+	if (!(w->spareblock=malloc(SIZE_METABLOCK))) GOTOERROR;
+	if (init_compress(&w->compressor,compress)) GOTOERROR;
+	if (pthread_create(&w->thread,NULL,worker_thread,w)) GOTOERROR;
+	pool->started+=1;
+}
 return 0;
 error:
 	return -1;
 }
 
-int compresstables_mkfs(struct temp_sqfs_mkfs *temp) {
-if (!temp->compress.zstream.opaque) return 0; // no gzip
-if (compress_metablock(temp,temp->inode_table.current,temp->inode_table.blockfill)) GOTOERROR;
-if (compress_metablock(temp,temp->directory_table.current,temp->directory_table.blockfill)) GOTOERROR;
-if (compress_metablock(temp,temp->idblock_table.current,temp->idblock_table.blockfill)) GOTOERROR;
+int init_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s, struct mapmem *mm, unsigned int blocksize, struct config_compress *compress,
+		unsigned int threads) {
+// threads: 0 => one per cpu, 1 => metablocks are compressed by the caller as they fill
+s->mm=mm;
+s->config.blocksize=blocksize;
+if (init_table(s,&s->inode_table)) GOTOERROR;
+if (init_table(s,&s->directory_table)) GOTOERROR;
+if (init_table(s,&s->idblock_table)) GOTOERROR;
+if (init_table(s,&s->fragment_table)) GOTOERROR;
+if (init_table(s,&s->export_table)) GOTOERROR;
+if (compress->level) {
+	if (!(s->compress.spareblock=alloc_mapmem(mm,SIZE_METABLOCK))) GOTOERROR;
+	if (!threads) {
+		long l;
+		l=sysconf(_SC_NPROCESSORS_ONLN);
+		threads=(l>0)?(unsigned int)l:1;
+	}
+	if (threads>MAXTHREADS_MKFS) threads=MAXTHREADS_MKFS;
+	if (threads>1) {
+		if (startpool(s,compress,threads)) GOTOERROR;
+	}
+}
+if (init_compress(&s->compress.compressor,compress)) GOTOERROR;
 return 0;
 error:
 	return -1;
 }
+void deinit_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s) {
+if (s->compress.pool) (void)stoppool(s->compress.pool);
+(void)deinit_compress(&s->compress.compressor);
+iffree(s->inode_table.places.list);
+iffree(s->directory_table.places.list);
+iffree(s->idblock_table.places.list);
+iffree(s->fragment_table.places.list);
+iffree(s->export_table.places.list);
+iffree(s->inode_table.image.data);
+iffree(s->directory_table.image.data);
+iffree(s->idblock_table.image.data);
+iffree(s->fragment_table.image.data);
+iffree(s->export_table.image.data);
+}
 
-static struct metablock_mkfs *swap_metablock(unsigned short *blocksize_out, struct temp_sqfs_mkfs *temp,
-		struct metablock_mkfs *current) {
-struct z_stream_s *zs;
-struct metablock_mkfs *nmb;
-unsigned char *data;
-unsigned short csize;
-int r;
+static int seal(struct temp_sqfs_mkfs *temp, struct table_mkfs *table) {
+// hands .current over to be compressed, it gets the pending patches that land in it
+struct pool_mkfs *pool=temp->compress.pool;
+struct metablock_mkfs *mb=table->current;
+struct patch_mkfs *p;
+int64_t start,end;
+
+mb->fill=table->blockfill;
+start=(int64_t)mb->index*SIZE_METABLOCK;
+end=start+mb->fill;
+while ((p=table->patches.first) && (p->position<end)) {
+	int isstraddle=(p->position+4>end);
+	table->patches.first=p->next;
+	if (isstraddle) { // the rest is in the next metablock, which needs the patch too
+		struct patch_mkfs *q;
+		if (!(q=alloc_mapmem(temp->mm,sizeof(struct patch_mkfs)))) GOTOERROR;
+		*q=*p;
+		table->patches.first=q;
+		if (table->patches.last==p) table->patches.last=q;
+	} else if (!p->next) table->patches.last=NULL;
+	p->position-=start;
+	p->next=mb->patches;
+	mb->patches=p;
+	if (isstraddle) break;
+}
 
-zs=&temp->compress.zstream;
+if (pool) (ignore)pthread_mutex_lock(&pool->mutex);
+if (mb->index+2>table->places.max) { // .list[.count+1] has to exist
+	struct place_mkfs *list;
+	unsigned int max=table->places.max*2;
+	if (!(list=realloc(table->places.list,max*sizeof(struct place_mkfs)))) {
+		if (pool) (ignore)pthread_mutex_unlock(&pool->mutex);
+		GOTOERROR;
+	}
+	memset(list+table->places.max,0,(max-table->places.max)*sizeof(struct place_mkfs));
+	table->places.list=list;
+	table->places.max=max;
+}
+if (pool) {
+	mb->next=NULL;
+	if (pool->last) pool->last->next=mb;
+	else pool->first=mb;
+	pool->last=mb;
+	pool->pending+=1;
+	(ignore)pthread_cond_broadcast(&pool->cond);
+	(ignore)pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
 
-if (!zs->opaque) { // gzip disabled
-	*blocksize_out=SIZE_METABLOCK;
-	return new_metablock(temp->mm,SIZE_METABLOCK);
+if (!isready(mb)) GOTOERROR; // everything sealed before mb is placed already
+(void)applypatches(mb);
+if (temp->compress.compressor.isinit) {
+	unsigned int saved;
+	if (compressblock(&saved,&temp->compress.compressor,temp->compress.spareblock,mb)) GOTOERROR;
+	temp->stats.bytessaved+=saved;
+}
+if (place(temp,mb)) GOTOERROR;
+return 0;
+error:
+	return -1;
 }
 
-zs->next_in=current->data;
-zs->avail_in=SIZE_METABLOCK;
-zs->next_out=temp->compress.spareblock;
-zs->avail_out=SIZE_METABLOCK;
-zs->total_out=0; // is this necessary? it isn't 0d by deflateReset
+static int waitpool(struct temp_sqfs_mkfs *temp, struct table_mkfs *table) {
+// waits until every sealed metablock of table is placed, NULL table => of every table
+struct pool_mkfs *pool=temp->compress.pool;
+int iserror;
+if (!pool) return 0;
+(ignore)pthread_mutex_lock(&pool->mutex);
+while (1) {
+	if (pool->iserror) break;
+	if (table) {
+		if (table->places.count>=table->blockindex) break;
+	} else if (!pool->pending) break;
+	(ignore)pthread_cond_wait(&pool->cond,&pool->mutex);
+}
+iserror=pool->iserror;
+if (!table) {
+	temp->stats.bytessaved+=pool->bytessaved;
+	pool->bytessaved=0;
+}
+(ignore)pthread_mutex_unlock(&pool->mutex);
+if (iserror) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
 
-r=deflate(zs,Z_FINISH);
-csize=zs->total_out;
-if ((r!=Z_STREAM_END) || (csize>=SIZE_METABLOCK)) {
-	if ((r!=Z_BUF_ERROR)&&(r!=Z_STREAM_END)) GOTOERROR;
+static int nextblock(struct temp_sqfs_mkfs *temp, struct table_mkfs *table) {
+struct metablock_mkfs *nmb;
 
-	if (Z_OK!=deflateReset(zs)) GOTOERROR;
-	*blocksize_out=SIZE_METABLOCK;
-	return new_metablock(temp->mm,SIZE_METABLOCK);
+if (!(nmb=new_metablock(temp,table,table->blockindex+1))) GOTOERROR;
+if (seal(temp,table)) GOTOERROR;
+table->current=nmb;
+table->blockindex+=1;
+table->blockfill=0;
+table->blockleft=SIZE_METABLOCK;
+return 0;
+error:
+	return -1;
 }
 
-if (!(nmb=new_metablock(temp->mm,csize))) GOTOERROR;
-current->compressedsize=csize;
-// fprintf(stderr,"%s:%d Successful gzip, %u -> %u\n",__FILE__,__LINE__,SIZE_METABLOCK,csize);
-temp->stats.bytessaved+=SIZE_METABLOCK-csize;
-data=nmb->data;
-memcpy(data,temp->compress.spareblock,csize);
-nmb->data=current->data;
-current->data=data;
+static int finishtable(struct temp_sqfs_mkfs *temp, struct table_mkfs *table) {
+if (seal(temp,table)) GOTOERROR;
+table->current=NULL; // it's a spare now, or will be
+return 0;
+error:
+	return -1;
+}
 
-if (Z_OK!=deflateReset(zs)) GOTOERROR;
-*blocksize_out=csize;
-return nmb;
+int compresstables_mkfs(struct temp_sqfs_mkfs *temp) {
+// seals the last metablocks and waits for all of them, after this the tables are final
+if (finishtable(temp,&temp->inode_table)) GOTOERROR;
+if (finishtable(temp,&temp->directory_table)) GOTOERROR;
+if (finishtable(temp,&temp->idblock_table)) GOTOERROR;
+if (temp->fragmentlist.count) {
+	if (finishtable(temp,&temp->fragment_table)) GOTOERROR;
+}
+if (temp->exportlist.refs) {
+	if (finishtable(temp,&temp->export_table)) GOTOERROR;
+}
+if (waitpool(temp,NULL)) GOTOERROR;
+// nothing more is compressed, the pool and the compressor state can go
+if (temp->compress.pool) {
+	(void)stoppool(temp->compress.pool);
+	temp->compress.pool=NULL;
+}
+(void)deinit_compress(&temp->compress.compressor);
+return 0;
 error:
-	return NULL;
+	return -1;
 }
 
 static int checkempty_table_mkfs(struct temp_sqfs_mkfs *temp, struct table_mkfs *table) {
-struct metablock_mkfs *current;
-struct metablock_mkfs *nmb;
-unsigned short blocksize;
-
 if (table->blockleft) return 0;
+return nextblock(temp,table);
+}
 
-current=table->current;
-if (!(nmb=swap_metablock(&blocksize,temp,current))) GOTOERROR;
-current->next=nmb;
-table->current=nmb;
-table->blockfill=0;
-table->blockleft=SIZE_METABLOCK;
-table->blockoffset+=blocksize+2;
-
+static int addpatch(struct temp_sqfs_mkfs *temp, struct table_mkfs *table, unsigned int at,
+		struct table_mkfs *target, unsigned int block) {
+// call right before appending a packet to table, the u32 at offset at in the packet gets the offset of target's metablock
+struct patch_mkfs *p;
+if (!(p=alloc_mapmem(temp->mm,sizeof(struct patch_mkfs)))) GOTOERROR;
+p->position=(int64_t)table->blockindex*SIZE_METABLOCK+table->blockfill+at;
+p->target=target;
+p->block=block;
+p->next=NULL;
+if (table->patches.last) table->patches.last->next=p;
+else table->patches.first=p;
+table->patches.last=p;
 return 0;
 error:
 	return -1;
 }
 
 static int append_table_mkfs(struct temp_sqfs_mkfs *temp, struct table_mkfs *table, unsigned char *packet, unsigned int num) {
-struct metablock_mkfs *current;
-
-current=table->current;
 while (1) {
 	unsigned int k;
 	if (!num) break;
 	k=num;
 	if (!table->blockleft) {
-		struct metablock_mkfs *nmb;
-		unsigned short blocksize;
-		if (!(nmb=swap_metablock(&blocksize,temp,current))) GOTOERROR;
-		current->next=nmb;
-		current=table->current=nmb;
-		table->blockfill=0;
-		table->blockleft=SIZE_METABLOCK;
-		table->blockoffset+=blocksize+2;
+		if (nextblock(temp,table)) GOTOERROR;
 	}
 	if (k>table->blockleft) k=table->blockleft;
-	memcpy(current->data+table->blockfill,packet,k);
+	memcpy(table->current->data+table->blockfill,packet,k);
 	table->blockfill+=k;
 	table->blockleft-=k;
 	num-=k;
@@ -235,6 +480,12 @@ return append_table_mkfs(temp,&temp->inode_table,packet,num);
 static int add_directory_mkfs(struct temp_sqfs_mkfs *temp, unsigned char *packet, unsigned int num) {
 return append_table_mkfs(temp,&temp->directory_table,packet,num);
 }
+static int add_fragmententry_mkfs(struct temp_sqfs_mkfs *temp, unsigned char *packet, unsigned int num) {
+return append_table_mkfs(temp,&temp->fragment_table,packet,num);
+}
+static int add_exportentry_mkfs(struct temp_sqfs_mkfs *temp, unsigned char *packet, unsigned int num) {
+return append_table_mkfs(temp,&temp->export_table,packet,num);
+}
 static int add_idblock_mkfs(struct temp_sqfs_mkfs *temp, unsigned char *packet, unsigned int num) {
 return append_table_mkfs(temp,&temp->idblock_table,packet,num);
 }
@@ -276,8 +527,12 @@ if (!temp->inode_table.blockleft) {
 	GOTOERROR;
 }
 
-cs->inode->blocksoffset=temp->inode_table.blockoffset;
+cs->inode->blockindex=temp->inode_table.blockindex;
 cs->inode->offsetinblock=temp->inode_table.blockfill;
+if (temp->exportlist.refs) { // fillexport_table_mkfs turns the metablock index into an offset
+	if ((!cs->inode->inodeindex) || (cs->inode->inodeindex>temp->exportlist.count)) GOTOERROR;
+	temp->exportlist.refs[cs->inode->inodeindex-1]=((uint64_t)cs->inode->blockindex<<16)|cs->inode->offsetinblock;
+}
 
 setu16(buffer+0,type);
 setu16(buffer+2,cs->mode);
@@ -291,6 +546,28 @@ error:
 	return -1;
 }
 
+struct basicdirectory_inode {
+	uint32_t block_index;
+	uint32_t link_count;
+	uint16_t file_size;
+	uint16_t block_offset;
+	uint32_t parent_inode;
+};
+
+static inline int addbasicdirectory(struct temp_sqfs_mkfs *temp, struct basicdirectory_inode *bd) {
+unsigned char buffer[16];
+setu32(buffer+0,bd->block_index);
+setu32(buffer+4,bd->link_count);
+setu16(buffer+8,bd->file_size);
+setu16(buffer+10,bd->block_offset);
+setu32(buffer+12,bd->parent_inode);
+if (addpatch(temp,&temp->inode_table,0,&temp->directory_table,bd->block_index)) GOTOERROR;
+if (add_inode_mkfs(temp,buffer,16)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
 struct exdirectory_inode {
 	uint32_t link_count;
 	uint32_t file_size;
@@ -310,6 +587,7 @@ setu32(buffer+12,exd->parent_inode);
 setu16(buffer+16,exd->index_count);
 setu16(buffer+18,exd->block_offset);
 setu32(buffer+20,exd->xattr_index);
+if (addpatch(temp,&temp->inode_table,8,&temp->directory_table,exd->block_index)) GOTOERROR;
 if (add_inode_mkfs(temp,buffer,24)) GOTOERROR;
 return 0;
 error:
@@ -320,17 +598,42 @@ int add_directory_inode_mkfs(struct temp_sqfs_mkfs *temp, struct directory_scan
 // dirsize: size in directory table, dirblock: start of block in directory table, diroffset: offset in block
 struct exdirectory_inode exd;
 
+if ((!d->indexcount) && (d->tablesize+3<=0xffff)) { // basic is enough
+	struct basicdirectory_inode bd;
+	if (addcommon(temp,&d->common,BASICDIRECTORY_TYPE_COMMON_INODE)) GOTOERROR;
+	bd.block_index=d->blockindex;
+	bd.link_count=d->linkcount;
+	bd.file_size=d->tablesize+3;
+	bd.block_offset=d->offsetinblock;
+	bd.parent_inode=(parent)?parent->common.inode->inodeindex:0;
+	if (addbasicdirectory(temp,&bd)) GOTOERROR;
+	return 0;
+}
+
 if (addcommon(temp,&d->common,EXDIRECTORY_TYPE_COMMON_INODE)) GOTOERROR;
 
 exd.link_count=d->linkcount;
-exd.file_size=d->tablesize;
-exd.block_index=d->blocksoffset;
+exd.file_size=d->tablesize+3; // clients count 3 bytes for "." and ".."
+exd.block_index=d->blockindex;
 exd.parent_inode=(parent)?parent->common.inode->inodeindex:0;
-exd.index_count=0;
+exd.index_count=d->indexcount;
 exd.block_offset=d->offsetinblock;
 exd.xattr_index=0;
 
 if (addexdirectory(temp,&exd)) GOTOERROR;
+{
+	unsigned int ui;
+	for (ui=0;ui<d->indexcount;ui++) {
+		struct dirindex_scan *di=&d->index[ui];
+		unsigned char buffer[12];
+		setu32(buffer+0,di->index);
+		setu32(buffer+4,di->start);
+		setu32(buffer+8,di->namelen-1);
+		if (addpatch(temp,&temp->inode_table,4,&temp->directory_table,di->start)) GOTOERROR;
+		if (add_inode_mkfs(temp,buffer,12)) GOTOERROR;
+		if (add_inode_mkfs(temp,(unsigned char *)di->name,di->namelen)) GOTOERROR;
+	}
+}
 return 0;
 error:
 	return -1;
@@ -349,6 +652,26 @@ struct exfile_inode {
 
 #define FS_UINT32	0xffffffff
 
+struct basicfile_inode {
+	uint32_t blocks_start;
+	uint32_t frag_index;
+	uint32_t block_offset;
+	uint32_t file_size;
+// follow this with an array of compressed sizes of blocks, as with exfile_inode
+};
+
+static inline int addbasicfile(struct temp_sqfs_mkfs *temp, struct basicfile_inode *bf) {
+unsigned char buffer[16];
+setu32(buffer+0,bf->blocks_start);
+setu32(buffer+4,bf->frag_index);
+setu32(buffer+8,bf->block_offset);
+setu32(buffer+12,bf->file_size);
+if (add_inode_mkfs(temp,buffer,16)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
 static inline int addexfile(struct temp_sqfs_mkfs *temp, struct exfile_inode *exfile) {
 unsigned char buffer[40];
 setu64(buffer+0,exfile->blocks_start);
@@ -364,16 +687,115 @@ error:
 	return -1;
 }
 
-static int addblocksizes(struct temp_sqfs_mkfs *temp, uint64_t size) {
+static uint64_t sizeinblocks(struct temp_sqfs_mkfs *temp, struct file_scan *f) {
+// bytes of the file that are in blocks and not in a fragment
+uint64_t size=f->size;
+if (f->isfragment) size-=size%temp->config.blocksize;
+return size;
+}
+
+static uint64_t countsparse(struct temp_sqfs_mkfs *temp, struct file_scan *f) {
+// bytes in sparse (0-size) blocks
 const unsigned int blocksize=temp->config.blocksize;
-while (size) {
-	unsigned char buff4[4];
-	unsigned int k;
-	k=blocksize;
-	if (size<k) k=size;
-	setu32(buff4,k|(1<<24)); // 16777216 is uncompressed bit
+uint64_t size,offset,sparse=0;
+unsigned int cursor=0;
+if (f->store && !f->store->israw) {
+	unsigned int ui;
+	for (ui=0;ui<f->store->blockcount;ui++) {
+		if (f->store->blocksizes[ui]) continue;
+		if (ui+1==f->store->blockcount) sparse+=f->size-(uint64_t)ui*blocksize;
+		else sparse+=blocksize;
+	}
+	return sparse;
+}
+if (!f->issparse) return 0;
+size=sizeinblocks(temp,f);
+for (offset=0;offset<size;offset+=blocksize) {
+	uint64_t end;
+	end=offset+blocksize;
+	if (end>size) end=size;
+	if (isholeblock_scan(&cursor,f,offset,end)) sparse+=end-offset;
+}
+return sparse;
+}
+
+static unsigned char *reservewords(unsigned int *count_inout, struct temp_sqfs_mkfs *temp) {
+// returns room for *count_inout 4-byte words, in place in the inode table, call commitwords after filling it
+// *count_inout is lowered to what fits in the metablock, 0 => the next word straddles metablocks, use add_inode_mkfs
+struct table_mkfs *table=&temp->inode_table;
+unsigned int n;
+if (checkempty_table_mkfs(temp,table)) return NULL;
+n=table->blockleft/4;
+if (n<*count_inout) *count_inout=n;
+return table->current->data+table->blockfill;
+}
+static inline void commitwords(struct temp_sqfs_mkfs *temp, unsigned int count) {
+temp->inode_table.blockfill+=count*4;
+temp->inode_table.blockleft-=count*4;
+}
+
+static int addblocksizes(struct temp_sqfs_mkfs *temp, struct file_scan *f) {
+// huge files have millions of blocks, so these are written in runs straight into the metablock
+const unsigned int blocksize=temp->config.blocksize;
+unsigned char buff4[4];
+uint64_t size,offset=0,count;
+unsigned int cursor=0;
+if (f->store && !f->store->israw) {
+	uint32_t *blocksizes=f->store->blocksizes;
+	count=f->store->blockcount;
+	while (count) {
+		unsigned char *dest;
+		unsigned int n,ui;
+		n=(count>SIZE_METABLOCK/4)?SIZE_METABLOCK/4:count;
+		if (!(dest=reservewords(&n,temp))) GOTOERROR;
+		if (!n) {
+			setu32(buff4,*blocksizes);
+			if (add_inode_mkfs(temp,buff4,4)) GOTOERROR;
+			n=1;
+		} else {
+			for (ui=0;ui<n;ui++) setu32(dest+ui*4,blocksizes[ui]);
+			commitwords(temp,n);
+		}
+		blocksizes+=n;
+		count-=n;
+	}
+	temp->stats.compressedfiles+=1;
+	return 0;
+}
+size=sizeinblocks(temp,f);
+count=size/blocksize; // full blocks, the last partial block is added at the end
+while (count) {
+	unsigned char *dest;
+	unsigned int n,ui;
+	n=(count>SIZE_METABLOCK/4)?SIZE_METABLOCK/4:count;
+	if (!(dest=reservewords(&n,temp))) GOTOERROR;
+	if (!n) {
+		n=1;
+		if (f->issparse && isholeblock_scan(&cursor,f,offset,offset+blocksize)) setu32(buff4,0);
+		else setu32(buff4,blocksize|(1<<24));
+		if (add_inode_mkfs(temp,buff4,4)) GOTOERROR;
+	} else if (!f->issparse) {
+		const uint32_t word=htole32(blocksize|(1<<24)); // 16777216 is uncompressed bit
+		for (ui=0;ui<n;ui++) memcpy(dest+ui*4,&word,4);
+		commitwords(temp,n);
+	} else {
+		for (ui=0;ui<n;ui++) {
+			if (isholeblock_scan(&cursor,f,offset+(uint64_t)ui*blocksize,offset+(uint64_t)(ui+1)*blocksize)) {
+				setu32(dest+ui*4,0); // sparse, range skips these too
+			} else {
+				setu32(dest+ui*4,blocksize|(1<<24));
+			}
+		}
+		commitwords(temp,n);
+	}
+	offset+=(uint64_t)n*blocksize;
+	count-=n;
+}
+if (offset<size) {
+	unsigned int k=size-offset;
+	if (f->issparse && isholeblock_scan(&cursor,f,offset,size)) setu32(buff4,0);
+	else setu32(buff4,k|(1<<24));
 	if (add_inode_mkfs(temp,buff4,4)) GOTOERROR;
-	size-=k;
 }
 return 0;
 error:
@@ -382,19 +804,37 @@ error:
 
 int add_file_inode_mkfs(struct temp_sqfs_mkfs *temp, struct file_scan *f) {
 struct exfile_inode exfile;
+struct file_scan *data; // has the block layout, f or the file it duplicates
 
-if (addcommon(temp,&f->common,EXFILE_TYPE_COMMON_INODE)) GOTOERROR;
+data=(f->dupof)?f->dupof:f;
 
 exfile.blocks_start=f->common.inode->dataoffset;
 exfile.file_size=f->size;
-exfile.sparse=0;
+exfile.sparse=countsparse(temp,data);
 exfile.link_count=f->common.inode->hardlinkcount;
-exfile.frag_index=FS_UINT32;
-exfile.block_offset=0;
+if (data->isfragment) {
+	exfile.frag_index=data->fragindex;
+	exfile.block_offset=data->fragoffset;
+} else {
+	exfile.frag_index=FS_UINT32;
+	exfile.block_offset=0;
+}
 exfile.xattr_index=FS_UINT32;
 
-if (addexfile(temp,&exfile)) GOTOERROR;
-if (addblocksizes(temp,f->size)) GOTOERROR;
+if ( (exfile.blocks_start<=UINT32_MAX) && (exfile.file_size<=UINT32_MAX)
+		&& (exfile.link_count==1) && (!exfile.sparse) ) { // basic is enough
+	struct basicfile_inode bf;
+	if (addcommon(temp,&f->common,BASICFILE_TYPE_COMMON_INODE)) GOTOERROR;
+	bf.blocks_start=exfile.blocks_start;
+	bf.frag_index=exfile.frag_index;
+	bf.block_offset=exfile.block_offset;
+	bf.file_size=exfile.file_size;
+	if (addbasicfile(temp,&bf)) GOTOERROR;
+} else {
+	if (addcommon(temp,&f->common,EXFILE_TYPE_COMMON_INODE)) GOTOERROR;
+	if (addexfile(temp,&exfile)) GOTOERROR;
+}
+if (addblocksizes(temp,data)) GOTOERROR;
 return 0;
 error:
 	return -1;
@@ -514,11 +954,11 @@ int count_dirsize_mkfs(struct dirsize_mkfs *dirsize, struct common_scan *common,
 signed short indexdelta;
 indexdelta=(signed short)(common->inode->inodeindex-dirsize->inodebasis);
 if ( (!dirsize->entryfuse)
-		|| ( common->inode->blocksoffset!=dirsize->blocksoffset)
+		|| ( common->inode->blockindex!=dirsize->blockindex)
 		|| ( common->inode->inodeindex!=dirsize->inodebasis+indexdelta) ) { // we need a new header
 	dirsize->size+=12;
 	if (dirsize->dirpeers_out) *dirsize->dirpeers_out=256-dirsize->entryfuse;
-	dirsize->blocksoffset=common->inode->blocksoffset;
+	dirsize->blockindex=common->inode->blockindex;
 	dirsize->inodebasis=common->inode->inodeindex;
 	dirsize->entryfuse=256;
 	dirsize->dirpeers_out=&common->dirpeers;
@@ -537,6 +977,7 @@ unsigned char buffer[12];
 setu32(buffer+0,hd->countm1);
 setu32(buffer+4,hd->start);
 setu32(buffer+8,hd->inode_number); // signed
+if (addpatch(temp,&temp->directory_table,4,&temp->inode_table,hd->start)) GOTOERROR;
 if (add_directory_mkfs(temp,buffer,12)) GOTOERROR;
 return 0;
 error:
@@ -555,13 +996,36 @@ error:
 	return -1;
 }
 
+static int addindex(struct dirsize_mkfs *dirsize, struct temp_sqfs_mkfs *temp, unsigned int listingoffset,
+		char *filename, unsigned int filenamelen) {
+// called before writing a header, it's indexed if it's the first to start in its metablock
+struct dirindex_scan *di;
+if (checkempty_table_mkfs(temp,&temp->directory_table)) GOTOERROR; // so .blockindex is where the header will be
+if (temp->directory_table.blockindex==dirsize->indexblock) return 0;
+if (dirsize->indexcount==dirsize->maxindex) GOTOERROR;
+di=&dirsize->index[dirsize->indexcount];
+dirsize->indexcount+=1;
+di->index=listingoffset;
+di->start=temp->directory_table.blockindex;
+di->name=filename;
+di->namelen=filenamelen;
+dirsize->indexblock=temp->directory_table.blockindex;
+return 0;
+error:
+	return -1;
+}
+
 static int add_directory_entry_mkfs(struct dirsize_mkfs *dirsize, struct temp_sqfs_mkfs *temp, struct common_scan *common,
 		unsigned short type, char *filename, unsigned int filenamelen) { 
 struct entry_directory e;
+unsigned int listingoffset=dirsize->size;
 if (count_dirsize_mkfs(dirsize,common,filenamelen)) {
 	struct header_directory hd;
+	if (dirsize->index) {
+		if (addindex(dirsize,temp,listingoffset,filename,filenamelen)) GOTOERROR;
+	}
 	hd.countm1=common->dirpeers -1;
-	hd.start=common->inode->blocksoffset;
+	hd.start=common->inode->blockindex;
 	hd.inode_number=common->inode->inodeindex;
 	if (adddirheader(temp,&hd)) GOTOERROR;
 }
@@ -648,13 +1112,9 @@ setu64(dest,sb->fragment_table_start); dest+=8;
 setu64(dest,sb->export_table_start);
 }
 
-unsigned int count_metablock_mkfs(struct metablock_mkfs *first) {
-unsigned int count=0;
-while (first) {
-	count+=1;
-	first=first->next;
-}
-return count;
+unsigned int count_table_mkfs(struct table_mkfs *table) {
+// metablocks in the table, including the unsealed one
+return table->blockindex+1;
 }
 
 static int fixandaddidblocks(unsigned int *index_inout, struct temp_sqfs_mkfs *temp, struct id_scan *idtop) {
@@ -685,41 +1145,76 @@ error:
 	return -1;
 }
 
-unsigned int size_table_mkfs(struct table_mkfs *table) {
-if (table->current->compressedsize) return table->blockoffset+2+table->current->compressedsize;
-return table->blockoffset+2+table->blockfill;
+int add_fragment_mkfs(struct temp_sqfs_mkfs *temp, uint64_t start, uint32_t size) {
+// start is relative to the archive, size has the uncompressed bit if applicable
+unsigned char buff16[16];
+setu64(buff16,start);
+setu32(buff16+8,size);
+setu32(buff16+12,0);
+if (add_fragmententry_mkfs(temp,buff16,16)) GOTOERROR;
+temp->fragmentlist.count+=1;
+return 0;
+error:
+	return -1;
 }
 
-unsigned int almost_size_metablock_mkfs(struct metablock_mkfs *mb) {
-// no need for last size in assemble
-if (mb->compressedsize) return mb->compressedsize;
-if (mb->next) return SIZE_METABLOCK;
+int setexport_mkfs(struct temp_sqfs_mkfs *temp, unsigned int inodecount) {
+// call before adding inodes, hardlinks are written once so each slot is set once
+if (!inodecount) return 0;
+if (!(temp->exportlist.refs=alloc_mapmem(temp->mm,inodecount*sizeof(uint64_t)))) GOTOERROR;
+temp->exportlist.count=inodecount;
 return 0;
+error:
+	return -1;
 }
 
-void copytable_mkfs(unsigned char **dest_inout, unsigned int *bytecount_inout, struct table_mkfs *table) {
-struct metablock_mkfs *mb;
+uint64_t inoderef_mkfs(struct temp_sqfs_mkfs *temp, struct inode_scan *inode) {
+// call after compresstables_mkfs
+return ((uint64_t)temp->inode_table.places.list[inode->blockindex].start<<16)|inode->offsetinblock;
+}
 
-mb=table->first;
-while (mb) {
-	unsigned short us;
+int fillexport_table_mkfs(struct temp_sqfs_mkfs *temp) {
+// call after all inodes are added
+struct place_mkfs *places;
+unsigned char buff8[8];
+unsigned int ui;
+if (waitpool(temp,&temp->inode_table)) GOTOERROR; // refs need the offsets of every inode metablock
+places=temp->inode_table.places.list;
+for (ui=0;ui<temp->exportlist.count;ui++) {
+	uint64_t ref=temp->exportlist.refs[ui];
+	setu64(buff8,((uint64_t)places[ref>>16].start<<16)|(ref&0xffff));
+	if (add_exportentry_mkfs(temp,buff8,8)) GOTOERROR;
+}
+temp->exportlist.listsize=count_table_mkfs(&temp->export_table)*8;
+return 0;
+error:
+	return -1;
+}
 
-	if (mb->compressedsize) {
-		us=mb->compressedsize;
-		setu16(*dest_inout,us);
-	} else {
-		if (mb->next) us=SIZE_METABLOCK;
-		else us=table->blockfill;
-		setu16(*dest_inout,32768|us);
-	}
+unsigned int size_table_mkfs(struct table_mkfs *table) {
+// call after compresstables_mkfs
+return table->image.len;
+}
 
+void copytable_mkfs(unsigned char **dest_inout, unsigned int *bytecount_inout, struct table_mkfs *table) {
+memcpy(*dest_inout,table->image.data,table->image.len);
+*dest_inout+=table->image.len;
+*bytecount_inout+=table->image.len;
+}
 
-// fprintf(stderr,"%s:%d writing metablock of size %u -> %u\n",__FILE__,__LINE__,us,us|32768);
-	*dest_inout+=2;
-	*bytecount_inout+=2;
-	memcpy(*dest_inout,mb->data,us);
-	*dest_inout+=us;
-	*bytecount_inout+=us;
-	mb=mb->next;
+void copylist_mkfs(unsigned char **dest_inout, unsigned int *bytecount_inout, struct table_mkfs *table, uint64_t tablestart) {
+// writes where each metablock is, tablestart is where table is in the archive
+unsigned int ui;
+for (ui=0;ui<=table->blockindex;ui++) {
+	setu64(*dest_inout,tablestart+table->places.list[ui].start);
+	*dest_inout+=8;
+	*bytecount_inout+=8;
 }
 }
+
+unsigned char *takeimage_mkfs(struct table_mkfs *table) {
+// the caller frees the result, size_table_mkfs still works
+unsigned char *data=table->image.data;
+table->image.data=NULL;
+return data;
+}
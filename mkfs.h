@@ -50,19 +50,50 @@ struct superblock_sqfs_mkfs {
 };
 #define NUM_SUPERBLOCK_SQFS_MKFS	96
 
+struct patch_mkfs { // a u32 that gets a metablock's offset, written before the offset is known
+	int64_t position; // in the uncompressed table while it's pending, then relative to the metablock (can be <0)
+	struct table_mkfs *target;
+	unsigned int block; // index of the metablock in .target
+	struct patch_mkfs *next;
+};
+
 struct metablock_mkfs {
 	unsigned short compressedsize; // 0 => not compressed
+	unsigned short fill; // bytes used, set when it's sealed
+	unsigned int index; // in .table
+	struct table_mkfs *table;
 	unsigned char *data;
-	struct metablock_mkfs *next;
+	struct patch_mkfs *patches; // fields in this metablock that point into other tables
+	struct metablock_mkfs *next; // in the compression queue or in the spares
+};
+
+struct place_mkfs {
+	unsigned int start; // offset of the metablock in the table, valid for the leading compressed ones
+	unsigned short size; // 2+bytes in the archive, 0 => not compressed yet
+	struct metablock_mkfs *metablock; // compressed, waiting for earlier ones to reach .image
 };
 
-struct table_mkfs { // total size will be .blockoffset+2+.blockfill
-	unsigned int blockoffset; // increases by 2+8192 every new block
+struct table_mkfs {
+	unsigned int blockindex; // metablocks before .current, refs into the table are made with this
 	unsigned int blockfill; // offset within current 8k block
 	unsigned int blockleft; // bytes left in current block
-	struct metablock_mkfs *first,*current;
+	struct metablock_mkfs *current;
+	struct {
+		struct patch_mkfs *first,*last; // not yet in a sealed metablock
+	} patches;
+	struct {
+		struct place_mkfs *list; // one per sealed metablock
+		unsigned int count; // leading metablocks with known offsets, [.count].start is set too
+		unsigned int max;
+	} places;
+	struct {
+		unsigned char *data; // placed metablocks as they are in the archive, with their 2-byte headers
+		unsigned int len,max;
+	} image;
 };
 
+struct pool_mkfs;
+
 struct temp_sqfs_mkfs {
 	struct mapmem *mm;
 	struct {
@@ -70,6 +101,8 @@ struct temp_sqfs_mkfs {
 	} config;
 	struct {
 		unsigned int bytessaved; // via compression
+		unsigned int compressedfiles; // files with compressed data blocks
+		unsigned int compressedfragments; // fragment blocks that are compressed
 	} stats;
 	struct table_mkfs inode_table;
 	struct {
@@ -81,28 +114,42 @@ struct temp_sqfs_mkfs {
 	struct {
 		unsigned int listsize; // number of bytes in list, =((scan.ids.count+1023)/1024)*8
 	} idblocklist;
+	struct table_mkfs fragment_table; // 16 bytes per fragment block
+	struct {
+		unsigned int count; // number of fragment blocks
+		unsigned int listsize; // number of bytes in list, =((.count+511)/512)*8
+	} fragmentlist;
+	struct table_mkfs export_table; // 8 bytes per inode, inode refs in inode number order
+	struct {
+		uint64_t *refs; // NULL => no export table, inode number n is at [n-1]
+		unsigned int count; // number of inodes
+		unsigned int listsize; // number of bytes in list, =((.count+1023)/1024)*8
+	} exportlist;
 	struct {
 		unsigned char *spareblock; // spare 8k for compressing
-		struct z_stream_s zstream;
+		struct compress compressor; // .config is set even if compression is off
+		struct pool_mkfs *pool; // NULL => metablocks are compressed as they're sealed
 	} compress;
+	struct metablock_mkfs *spares; // metablocks that are in an .image already, for reuse
 };
 
 // used for pre-counting directory sizes
 struct dirsize_mkfs {
 	unsigned int size;
 
-	unsigned int blocksoffset;
+	unsigned int blockindex;
 	unsigned int inodebasis;
 	unsigned int entryfuse; // max is 256
 	unsigned int *dirpeers_out; // save the count of entries here
+
+	struct dirindex_scan *index; // NULL => no index, when writing
+	unsigned int indexcount,maxindex;
+	unsigned int indexblock; // metablock of the last index entry (or of the listing's start)
 };
 
-int init_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s, struct mapmem *mm, unsigned int blocksize, unsigned int gziplevel);
-#if 1
-#define deinit_temp_sqfs_mkfs(a) do{}while(0)
-#else
+int init_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s, struct mapmem *mm, unsigned int blocksize, struct config_compress *compress,
+		unsigned int threads);
 void deinit_temp_sqfs_mkfs(struct temp_sqfs_mkfs *s);
-#endif
 int add_file_inode_mkfs(struct temp_sqfs_mkfs *temp, struct file_scan *f);
 int add_directory_inode_mkfs(struct temp_sqfs_mkfs *temp, struct directory_scan *d, struct directory_scan *parent);
 int add_symlink_inode_mkfs(struct temp_sqfs_mkfs *temp, struct symlink_scan *s, char *filename, unsigned int filenamelen);
@@ -116,9 +163,14 @@ int add_symlink_dirent_mkfs(struct dirsize_mkfs *dirsize, struct temp_sqfs_mkfs
 int add_bdev_dirent_mkfs(struct dirsize_mkfs *dirsize, struct temp_sqfs_mkfs *temp, struct dirent_scan *de);
 int add_cdev_dirent_mkfs(struct dirsize_mkfs *dirsize, struct temp_sqfs_mkfs *temp, struct dirent_scan *de);
 void fill_superblock_sqfs_mkfs(unsigned char *dest, struct superblock_sqfs_mkfs *sb);
-unsigned int count_metablock_mkfs(struct metablock_mkfs *first);
+unsigned int count_table_mkfs(struct table_mkfs *table);
 int fixandadd_idblocks_mkfs(struct temp_sqfs_mkfs *temp, struct id_scan *idtop);
 unsigned int size_table_mkfs(struct table_mkfs *table);
-unsigned int almost_size_metablock_mkfs(struct metablock_mkfs *mb);
 void copytable_mkfs(unsigned char **dest_inout, unsigned int *bytecount_inout, struct table_mkfs *table);
+void copylist_mkfs(unsigned char **dest_inout, unsigned int *bytecount_inout, struct table_mkfs *table, uint64_t tablestart);
+unsigned char *takeimage_mkfs(struct table_mkfs *table);
 int compresstables_mkfs(struct temp_sqfs_mkfs *temp);
+uint64_t inoderef_mkfs(struct temp_sqfs_mkfs *temp, struct inode_scan *inode);
+int add_fragment_mkfs(struct temp_sqfs_mkfs *temp, uint64_t start, uint32_t size);
+int setexport_mkfs(struct temp_sqfs_mkfs *temp, unsigned int inodecount);
+int fillexport_table_mkfs(struct temp_sqfs_mkfs *temp);
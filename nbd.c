@@ -28,18 +28,24 @@
 #include <syslog.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <zlib.h>
 #ifdef HAVETLS
 #include <gnutls/gnutls.h>
 #endif
 // #define DEBUG2
 #include "common/conventions.h"
 #include "common/mmapread.h"
+#include "common/mapmem.h"
 #include "common/blockmem.h"
 #include "common/unixaf.h"
 #include "common/overwrite_environ.h"
+#include "common/fileio.h"
 #include "misc.h"
 #include "options.h"
+#include "scan.h"
 #include "range.h"
+#include "compress.h"
+#include "store.h"
 #include "export.h"
 #include "tcpsocket.h"
 
@@ -337,6 +343,10 @@ if (!one_export) {
 		errflag=NBD_REP_ERR_UNKNOWN;
 		errmsg="No export matches"; // we don't really want to say if it's because of an IP rejection as that could leak info
 	}
+} else if (ispending_export(exports,one_export)) { // our copy was forked mid-build, it'll never finish here
+	errflag=NBD_REP_ERR_SHUTDOWN;
+	errmsg="Export is still being built, try again shortly";
+	syslog(LOG_INFO,"Client asked for export %s while it's still building",one_export->name);
 } else {
 	if (!one_export->isbuilt) {
 		if (build_one_export(one_export,nbd->options)) {
@@ -32,27 +32,20 @@
 // #define DEBUG2
 #include "common/conventions.h"
 #include "common/mmapread.h"
+#include "common/mapmem.h"
 #include "options.h"
 
 #include "range.h"
 
-static inline unsigned char *alloc_name(struct range *range, unsigned int len) {
-unsigned int num;
-unsigned char *d;
-num=range->names.num;
-if (num+len>range->names.max) {
-	syslog(LOG_ERR,"Wanted %u bytes but only %u are left",len,range->names.max-num);
-	GOTOERROR;
-}
-d=range->names.data+num;
-range->names.num+=len;
-return d;
-error:
-	return NULL;
-}
+#define NODESIZE_NAMES_RANGE	(1<<16)
 
 unsigned char *alloc_name_range(struct range *range, unsigned int len) {
-return alloc_name(range,len);
+return alloc_mapmem(&range->names,len);
+}
+
+char *dupname_range(struct range *range, char *name, unsigned int len) {
+// range outlives the scan, so names it opens by are copied, the rest stay with the scan
+return strdup3_mapmem(&range->names,name,len);
 }
 
 static struct entry_range *nextfreeentry(struct range *range, uint64_t len) {
@@ -95,8 +88,9 @@ error:
 	return -1;
 }
 
-int noalloc_add_external_range(struct range *range, struct directory_range *directory, char *filename,
-		uint64_t len) {
+int noalloc_addpart_external_range(struct range *range, struct directory_range *directory, char *filename,
+		uint64_t fileoffset, uint64_t len) {
+// only len bytes, starting at fileoffset, are in the archive
 struct entry_range *e;
 
 #ifdef DEBUG
@@ -108,41 +102,23 @@ if (!(e=nextfreeentry(range,len))) GOTOERROR;
 e->type=EXTERNAL_TYPE_RANGE;
 e->external.directory=directory;
 e->external.filename=filename;
+e->external.fileoffset=fileoffset;
 return 0;
 error:
 	return -1;
 }
 
-int add_external_range(struct range *range, struct directory_range *directory, char *filename_in,
-		unsigned int namelen, uint64_t len) {
-char *filename;
-namelen+=1;
-if (!(filename=(char *)alloc_name(range,namelen))) GOTOERROR;
-memcpy(filename,filename_in,namelen);
-#if 0
-fprintf(stderr,"Allocated name: \"%s\" (%u of %u)\n",e->external.filename,namelen,range->names.max-range->names.num);
-#endif
-return noalloc_add_external_range(range,directory,filename,len);
-error:
-	return -1;
+int noalloc_add_external_range(struct range *range, struct directory_range *directory, char *filename,
+		uint64_t len) {
+return noalloc_addpart_external_range(range,directory,filename,0,len);
 }
 
-struct directory_range *add_directory_range(struct range *range, struct directory_range *parent,
-		char *name, unsigned int namelen) {
+struct directory_range *add_directory_range(struct range *range, struct directory_range *parent, char *name) {
 struct directory_range *d;
 unsigned int num;
 char *fn;
 
-#ifdef DEBUG2
-if (!namelen) GOTOERROR;
-#endif
-
-namelen+=1;
-if (!(fn=(char *)alloc_name(range,namelen))) GOTOERROR;
-memcpy(fn,name,namelen);
-#if 0
-DEBUGOUT((stderr,"%s:%d Allocated name: \"%s\" (%u of %u)\n",__FILE__,__LINE__,fn,namelen,range->names.max-range->names.num));
-#endif
+if (!(fn=dupname_range(range,name,strlen(name)))) GOTOERROR;
 
 num=range->directories.num;
 if (num==range->directories.max) GOTOERROR;
@@ -156,7 +132,8 @@ error:
 	return NULL;
 }
 
-int init_range(struct range *range, unsigned int maxentries, unsigned int maxdirs, unsigned int maxnames, unsigned int maxdepth) {
+int init_range(struct range *range, unsigned int maxentries, unsigned int maxdirs, unsigned int maxdepth,
+		struct config_range *config) {
 if (!(range->entries.list=malloc(sizeof(struct entry_range)*maxentries))) GOTOERROR;
 range->entries.num=0;
 range->entries.max=maxentries;
@@ -165,14 +142,13 @@ if (!(range->directories.list=malloc(sizeof(struct directory_range)*maxdirs))) G
 range->directories.num=0;
 range->directories.max=maxdirs;
 
-if (!(range->names.data=malloc(maxnames))) GOTOERROR;
-range->names.num=0;
-range->names.max=maxnames; 
-
 if (!(range->temp.unwinddirs=malloc(maxdepth*sizeof(struct directory_range *)))) GOTOERROR;
 range->temp.maxdepth_unwinddirs=maxdepth;
 
-voidinit_match_range(&range->cache.match,1<<16);
+if (init_mapmem(&range->names,NODESIZE_NAMES_RANGE)) GOTOERROR;
+
+range->config=*config;
+voidinit_match_range(&range->cache.match,1<<16,config->mmapwindow);
 
 return 0;
 error:
@@ -182,8 +158,10 @@ error:
 void deinit_range(struct range *range) {
 iffree(range->entries.list);
 iffree(range->directories.list);
-iffree(range->names.data);
+deinit_mapmem(&range->names);
 iffree(range->extra.other);
+iffree(range->extra.inodes);
+iffree(range->extra.directories);
 iffree(range->temp.unwinddirs);
 deinit_match_range(&range->cache.match);
 }
@@ -193,19 +171,20 @@ void reset_range(struct range *range) {
 (void)deinit_range(range);
 range->entries.list=NULL;
 range->directories.list=NULL;
-range->names.data=NULL;
+range->names.first=range->names.current=NULL;
 range->extra.other=NULL;
+range->extra.inodes=NULL;
+range->extra.directories=NULL;
 range->temp.unwinddirs=NULL;
 (void)clear_match_range(&range->cache.match);
 }
 
-static int openexternalfile(int *fd_out, struct range *range, struct directory_range *directory, char *filename,
-		struct options *options) {
+int opendirectory_range(int *fd_out, struct range *range, struct directory_range *directory) {
 // Not thread-safe
 struct directory_range **list;
 struct directory_range *d;
 unsigned int depth=0;
-int dfd=-1,ffd=-1;
+int dfd=-1;
 
 list=range->temp.unwinddirs; // not thread safe
 d=directory;
@@ -230,7 +209,28 @@ while (1) {
 	(ignore)close(dfd);
 	dfd=newfd;
 }
+*fd_out=dfd;
+return 0;
+error:
+	ignore_ifclose(dfd);
+	return -1;
+}
 
+static int openexternalfile(int *fd_out, struct range *range, struct directory_range *directory, char *filename,
+		struct options *options) {
+// Not thread-safe
+int dfd=-1,ffd=-1;
+
+if (!directory) { // overlay files have a full path
+	if (0>(ffd=open(filename,O_RDONLY))) {
+		syslog(LOG_ERR,"Error opening file: %s %s",filename,strerror(errno));
+		GOTOERROR;
+	}
+	*fd_out=ffd;
+	return 0;
+}
+
+if (opendirectory_range(&dfd,range,directory)) GOTOERROR;
 if (0>(ffd=openat(dfd,filename,O_RDONLY))) {
 	if (options->isverbose) {
 		syslog(LOG_ERR,"Error opening file: %s %s, directory path follows",filename,strerror(errno));
@@ -351,7 +351,7 @@ error:
 	return -1;
 }
 
-static int setexternal_match(struct match_range *match_inout, struct range *range, uint64_t fileoffset, struct entry_range *entry,
+static int setexternal_match(struct match_range *match_inout, struct range *range, uint64_t rangeoffset, struct entry_range *entry,
 		struct options *options) {
 int fd=-1;
 struct mmapread *smmap;
@@ -360,7 +360,7 @@ uint64_t u;
 if (openexternalfile(&fd,range,entry->external.directory,entry->external.filename,options)) GOTOERROR;
 // note that actual fileoffset may vary and length may be limited to 32bits
 smmap=&match_inout->mmapread;
-if (readoff_mmapread(smmap,fd,fileoffset,fd)) {
+if (readoff_mmapread(smmap,fd,entry->external.fileoffset+rangeoffset,fd)) {
 	syslog(LOG_ERR,"Error mmaping %s %s",entry->external.filename,strerror(errno));
 	GOTOERROR; 
 }
@@ -371,10 +371,10 @@ if (!smmap->datasize) { // file got truncated under us, can send 0s to client an
 	return 0;
 }
 #if 0
- fprintf(stderr,"externalmatch, fileoffset:%"PRIu64" mmapoffset:%"PRIu64" addrsize:%u\n", fileoffset,smmap->offset,smmap->addrsize);
+ fprintf(stderr,"externalmatch, rangeoffset:%"PRIu64" mmapoffset:%"PRIu64" addrsize:%u\n", rangeoffset,smmap->offset,smmap->addrsize);
 #endif
 match_inout->data=smmap->data;
-u=entry->startpluslen - entry->start - fileoffset;
+u=entry->startpluslen - entry->start - rangeoffset;
 if (u>smmap->datasize) u=smmap->datasize;
 #if UINT_MAX==UINT32_MAX
 	if (u>UINT32_MAX) u=UINT32_MAX;
@@ -397,9 +397,15 @@ if (offset < e->start) return 0;
 if (offset >= e->startpluslen) return 0;
 left=e->startpluslen-offset;
 offset -= e->start; // now offset in file
+if (e->type==EXTERNAL_TYPE_RANGE) offset+=e->external.fileoffset;
 
 m=&range->cache.match;
-if (isoffsetchanged_mmapread(&m->mmapread,offset)) {
+if (!isoffsetchanged_mmapread(&m->mmapread,offset)) {
+	// same file, outside the window: move the window rather than reopen the file
+	if (slide_mmapread(&m->mmapread,offset)) return 0;
+}
+(void)stream_mmapread(&m->mmapread,offset);
+{
 	uint64_t u;
 	m->data=m->mmapread.data;
 	u=m->mmapread.datasize;
@@ -408,9 +414,8 @@ if (isoffsetchanged_mmapread(&m->mmapread,offset)) {
 	if (u > UINT32_MAX) u=UINT32_MAX;
 #endif
 	m->len=(unsigned int)u;
-	return 1;
 }
-return 0;
+return 1;
 }
 
 struct match_range *finddata_range(struct range *range, uint64_t offset, struct options *options) {
@@ -458,6 +463,9 @@ while (1) {
 				}
 				break;
 		}
+		if (list->type==EXTERNAL_TYPE_RANGE) rangeoffset+=list->external.fileoffset; // now offset in file
+		(void)startstream_mmapread(&m->mmapread,rangeoffset,range->config.readahead,
+				range->config.dropbehind && (list->startpluslen-list->start >= range->config.dropbehind));
 		range->cache.entry=list;
 		return m;
 	}
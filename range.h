@@ -31,7 +31,7 @@ struct entry_range {
 	unsigned int type:2;
 	union {
 		struct { unsigned char *data; unsigned int len; } internal;
-		struct { struct directory_range *directory; char *filename; } external;
+		struct { struct directory_range *directory; char *filename; uint64_t fileoffset; } external; // .start is at .fileoffset
 		struct { int fd; char *filename; } fd; // filename is for debugging, size is .startpluslen-.start
 	};
 };
@@ -43,6 +43,12 @@ struct match_range {
 	struct mmapread mmapread;
 };
 
+struct config_range {
+	uint64_t mmapwindow; // see voidinit_mmapread
+	uint64_t dropbehind; // entries this large or larger are streamed without keeping them cached, 0 => off
+	unsigned int readahead; // max read-ahead for sequential readers, 0 => off
+};
+
 struct range {
 	struct {
 		unsigned int num,max;
@@ -53,10 +59,7 @@ struct range {
 		unsigned int num,max;
 		struct directory_range *list;
 	} directories;
-	struct {
-		unsigned int num,max;
-		unsigned char *data; // this can include superblock, includes file names and dir names, no need for symlinks
-	} names;
+	struct mapmem names; // names of the files and dirs that are opened later, the superblock and fragment blocks
 	struct {
 		unsigned int maxdepth_unwinddirs;
 		struct directory_range **unwinddirs;
@@ -67,21 +70,27 @@ struct range {
 	} cache;
 	struct {
 		unsigned char *other; // this should be freed, use for sqfs tables
+		unsigned char *inodes,*directories; // these too, the inode and directory tables as mkfs laid them out
 	} extra;
+	struct config_range config;
 };
 
 #define overclear_range(a) do { overclear_mmapread(&(a)->cache.match.mmapread); } while (0)
-int init_range(struct range *range, unsigned int maxentries, unsigned int maxdirs, unsigned int maxnames, unsigned int maxdepth);
+int init_range(struct range *range, unsigned int maxentries, unsigned int maxdirs, unsigned int maxdepth,
+		struct config_range *config);
 void deinit_range(struct range *range);
 void reset_range(struct range *range);
 int add_internal_range(struct range *range, unsigned char *data, unsigned int len);
-struct directory_range *add_directory_range(struct range *range, struct directory_range *parent, char *name, unsigned int namelen);
-int add_external_range(struct range *range, struct directory_range *directory, char *filename_in, unsigned int namelen, uint64_t len);
+struct directory_range *add_directory_range(struct range *range, struct directory_range *parent, char *name);
 int noalloc_add_fd_range(struct range *range, int fd, char *filename, uint64_t len);
 int noalloc_add_external_range(struct range *range, struct directory_range *directory, char *filename, uint64_t len);
+int noalloc_addpart_external_range(struct range *range, struct directory_range *directory, char *filename,
+		uint64_t fileoffset, uint64_t len);
 unsigned char *alloc_name_range(struct range *range, unsigned int len);
+char *dupname_range(struct range *range, char *name, unsigned int len);
+int opendirectory_range(int *fd_out, struct range *range, struct directory_range *directory);
 int dump_range(struct range *range, char *filename);
 struct match_range *finddata_range(struct range *range, uint64_t offset, struct options *options);
-#define voidinit_match_range(a,b) do { voidinit_mmapread(&(a)->mmapread,b); } while (0)
+#define voidinit_match_range(a,b,c) do { voidinit_mmapread(&(a)->mmapread,b,c); } while (0)
 #define reset_match_range(a) do { (a)->iserror=0; (void)reset_mmapread(&((a)->mmapread)); } while (0)
 #define deinit_match_range(a) deinit_mmapread(&((a)->mmapread))
@@ -33,21 +33,67 @@
 #include <fcntl.h>
 #undef __USE_GNU
 #include <errno.h>
+#include <pthread.h>
+#ifdef HAVEIOURING
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#endif
 // #define DEBUG2
 #include "common/conventions.h"
 #include "common/mapmem.h"
+#include "common/uring.h"
 #include "options.h"
 #include "misc.h"
 
 #include "scan.h"
 
 #include "sort_id_scan.h"
-#include "sort_inode_scan.h"
 #include "sort_dirent_scan.h"
 
 // #define OPENDIRFLAGS (O_RDONLY|O_DIRECTORY|O_NOATIME)
 #define OPENDIRFLAGS (O_RDONLY|O_DIRECTORY)
+#ifndef SEEK_DATA
+// linux values, unistd.h hides these without _GNU_SOURCE
+#define SEEK_DATA	3
+#define SEEK_HOLE	4
+#endif
 #define MODEMASK	(S_IRWXU|S_IRWXG|S_IRWXO|S_ISUID|S_ISGID|S_ISVTX)
+#define MAXTHREADS_SCAN	64
+#define SHARDS_SCAN	64 // link tables in a threaded scan, each with its own lock
+#define MINSLOTS_LINKS	1024
+#define BATCH_STATX	64 // directory entries with a statx in flight at once
+#define MASK_STATX	(STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_INO|STATX_UID|STATX_GID|STATX_MTIME|STATX_SIZE|STATX_BLOCKS)
+
+struct job_scan { // a directory for a worker to read
+	struct directory_scan *directory;
+	unsigned int depth; // of the parent
+	char *path; // allocated with the job
+	struct job_scan *next;
+};
+
+struct shared_scan {
+	pthread_mutex_t mutex; // for .jobs, .busy and .iserror
+	pthread_cond_t cond;
+	struct job_scan *jobs; // a stack, deepest first keeps it short
+	unsigned int busy; // workers reading a directory, these can add jobs
+	int iserror;
+	unsigned int files; // for maxfiles, counted across workers
+	pthread_mutex_t idmutex; // for .main's ids
+	struct scan *main;
+	struct options *options;
+	struct {
+		pthread_mutex_t mutex;
+		struct links_scan links;
+	} shards[SHARDS_SCAN];
+};
+
+struct worker_scan {
+	pthread_t thread;
+	struct shared_scan *shared;
+	struct scan scan; // private arenas and counts, merged into .shared->main after join
+	struct id_scan *lastids[2]; // most files share owners, this skips the lock
+	char *path; // of the directory being read
+};
 
 SICLEARFUNC(directory_scan);
 #if 1
@@ -69,8 +115,30 @@ SICLEARFUNC(dirent_scan);
 #define clear_dirent_scan(a) do {} while (0)
 #endif
 
+static void adddirent(struct directory_scan *directory, struct dirent_scan *de) {
+if (directory->islisting) { // add_dir sorts them all at once
+	de->next=directory->entries.first;
+	directory->entries.first=de;
+} else {
+	(void)add_sort_dirent_scan(&directory->entries.top,de);
+}
+}
+
 static int register_id_scan(struct id_scan **id_out, struct scan *scan, uint32_t id_in) {
+struct worker_scan *w=scan->worker;
 struct id_scan *id;
+if (w) { // workers share the main scan's ids
+	int r;
+	if (w->lastids[0] && (w->lastids[0]->id==id_in)) { *id_out=w->lastids[0]; return 0; }
+	if (w->lastids[1] && (w->lastids[1]->id==id_in)) { *id_out=w->lastids[1]; return 0; }
+	(ignore)pthread_mutex_lock(&w->shared->idmutex);
+	r=register_id_scan(id_out,w->shared->main,id_in);
+	(ignore)pthread_mutex_unlock(&w->shared->idmutex);
+	if (r) GOTOERROR;
+	w->lastids[1]=w->lastids[0];
+	w->lastids[0]=*id_out;
+	return 0;
+}
 id=find_sort_id_scan(scan->ids.top,id_in);
 if (id) {
 	*id_out=id;
@@ -101,44 +169,121 @@ inode->hardlinkcount=1;
 return inode;
 }
 
+static inline unsigned int hashinode(uint64_t number, dev_t devnumber) {
+uint64_t h;
+h=(number^((uint64_t)devnumber<<40))*0x9e3779b97f4a7c15ULL;
+return h>>32;
+}
+
+static int growlinks(struct links_scan *links) {
+struct inode_scan **slots;
+unsigned int size,ui;
+size=(links->mask)?(links->mask+1)*2:MINSLOTS_LINKS;
+if (!(slots=ZTMALLOC(size,struct inode_scan *))) GOTOERROR;
+if (links->slots) {
+	for (ui=0;ui<=links->mask;ui++) {
+		struct inode_scan *inode;
+		unsigned int i;
+		if (!(inode=links->slots[ui])) continue;
+		i=hashinode(inode->number,inode->devnumber)&(size-1);
+		while (slots[i]) i=(i+1)&(size-1);
+		slots[i]=inode;
+	}
+	free(links->slots);
+}
+links->slots=slots;
+links->mask=size-1;
+return 0;
+error:
+	return -1;
+}
+
+static int findadd_inode(struct inode_scan **found_out, struct links_scan *links, struct inode_scan *inode) {
+// returns the inode with the same (dev,ino) if there is one, with another hardlink counted, otherwise adds inode
+struct inode_scan *found;
+unsigned int i;
+if (2*(links->count+1)>links->mask) {
+	if (growlinks(links)) GOTOERROR;
+}
+i=hashinode(inode->number,inode->devnumber)&links->mask;
+while ((found=links->slots[i])) {
+	if ((found->number==inode->number) && (found->devnumber==inode->devnumber)) {
+		found->hardlinkcount+=1;
+		*found_out=found;
+		return 0;
+	}
+	i=(i+1)&links->mask;
+}
+links->slots[i]=inode;
+links->count+=1;
+*found_out=inode;
+return 0;
+error:
+	return -1;
+}
+
 static struct inode_scan *new_inode(struct scan *scan, struct stat *st, unsigned int type, void *vptr) {
-struct inode_scan *inode;
-if (!(inode=pseudo_inode(scan,type,vptr))) GOTOERROR;
+// if st is a hardlink, this returns the existing inode, with a different ->vptr
+struct inode_scan *inode,*found;
+if (!(inode=S_MAPMEM(&scan->mapmem,struct inode_scan))) GOTOERROR;
+clear_inode_scan(inode);
+inode->type=type;
+inode->vptr=vptr;
+inode->hardlinkcount=1;
 inode->number=st->st_ino;
 inode->devnumber=st->st_dev;
-(void)add_sort_inode_scan(&scan->inodes.top,inode);
+if ((st->st_nlink>1) || (type==DIRECTORY_TYPE_SCAN)) { // anything else can only be seen once, directories for loops
+	int r;
+	if (scan->worker) {
+		struct shared_scan *shared=scan->worker->shared;
+		unsigned int shard;
+		shard=(st->st_ino^st->st_dev)%SHARDS_SCAN;
+		(ignore)pthread_mutex_lock(&shared->shards[shard].mutex);
+		r=findadd_inode(&found,&shared->shards[shard].links,inode);
+		(ignore)pthread_mutex_unlock(&shared->shards[shard].mutex);
+	} else {
+		r=findadd_inode(&found,&scan->inodes.links,inode);
+	}
+	if (r) GOTOERROR;
+	if (found!=inode) return found;
+}
+inode->next=scan->inodes.first;
+scan->inodes.first=inode;
+scan->counts.inodes+=1;
 return inode;
 error:
 	return NULL;
 }
 
+static inline int countfile(struct scan *scan) {
+// -1 when we reach maxfiles
+scan->counts.files+=1;
+if (scan->worker) return (__sync_add_and_fetch(&scan->worker->shared->files,1)==scan->config.maxfiles)?-1:0;
+return (scan->counts.files==scan->config.maxfiles)?-1:0;
+}
+
 static int addcdev_directory_scan(struct directory_scan *directory, struct scan *scan, struct stat *st, char *filename) {
 struct dirent_scan *de;
 struct cdev_scan *c;
 struct inode_scan *inode;
 
 directory->linkcount+=1;
-scan->counts.files+=1;
-if (scan->counts.files==scan->config.maxfiles) GOTOERROR;
-
-inode=find_sort_inode_scan(scan->inodes.top,st->st_ino,st->st_dev);
-if (inode) {
+if (countfile(scan)) GOTOERROR;
+
+if (!(c=S_MAPMEM(&scan->mapmem,struct cdev_scan))) GOTOERROR;
+clear_cdev_scan(c);
+c->common.mode=st->st_mode&MODEMASK;
+if (register_id_scan(&c->common.uid,scan,st->st_uid)) GOTOERROR;
+if (register_id_scan(&c->common.gid,scan,st->st_gid)) GOTOERROR;
+c->common.mtime=st->st_mtim.tv_sec;
+c->major=major(st->st_rdev);
+c->minor=minor(st->st_rdev);
+
+if (!(inode=new_inode(scan,st,CDEV_TYPE_SCAN,(void *)c))) GOTOERROR;
+if (inode->vptr!=c) { // hardlink
 	if (inode->type!=CDEV_TYPE_SCAN) GOTOERROR;
-	inode->hardlinkcount+=1;
 	c=inode->cdev;
 } else {
-	if (!(c=S_MAPMEM(&scan->mapmem,struct cdev_scan))) GOTOERROR;
-	clear_cdev_scan(c);
-
-	c->common.mode=st->st_mode&MODEMASK;
-	if (register_id_scan(&c->common.uid,scan,st->st_uid)) GOTOERROR;
-	if (register_id_scan(&c->common.gid,scan,st->st_gid)) GOTOERROR;
-	c->common.mtime=st->st_mtim.tv_sec;
-	c->major=major(st->st_rdev);
-	c->minor=minor(st->st_rdev);
-
-	if (!(inode=new_inode(scan,st,CDEV_TYPE_SCAN,(void *)c))) GOTOERROR;
-
 	c->common.inode=inode;
 }
 
@@ -150,9 +295,8 @@ de->type=CDEV_TYPE_SCAN;
 de->cdev=c;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
-(void)add_sort_dirent_scan(&directory->entries.top,de);
+(void)adddirent(directory,de);
 
-// scan->counts.namelens+=de->filenamelen; // devices aren't stored in range
 return 0;
 error:
 	return -1;
@@ -164,27 +308,22 @@ struct bdev_scan *b;
 struct inode_scan *inode;
 
 directory->linkcount+=1;
-scan->counts.files+=1;
-if (scan->counts.files==scan->config.maxfiles) GOTOERROR;
-
-inode=find_sort_inode_scan(scan->inodes.top,st->st_ino,st->st_dev);
-if (inode) {
+if (countfile(scan)) GOTOERROR;
+
+if (!(b=S_MAPMEM(&scan->mapmem,struct bdev_scan))) GOTOERROR;
+clear_bdev_scan(b);
+b->common.mode=st->st_mode&MODEMASK;
+if (register_id_scan(&b->common.uid,scan,st->st_uid)) GOTOERROR;
+if (register_id_scan(&b->common.gid,scan,st->st_gid)) GOTOERROR;
+b->common.mtime=st->st_mtim.tv_sec;
+b->major=major(st->st_rdev);
+b->minor=minor(st->st_rdev);
+
+if (!(inode=new_inode(scan,st,BDEV_TYPE_SCAN,b))) GOTOERROR;
+if (inode->vptr!=b) { // hardlink
 	if (inode->type!=BDEV_TYPE_SCAN) GOTOERROR;
-	inode->hardlinkcount+=1;
 	b=inode->bdev;
 } else {
-	if (!(b=S_MAPMEM(&scan->mapmem,struct bdev_scan))) GOTOERROR;
-	clear_bdev_scan(b);
-
-	b->common.mode=st->st_mode&MODEMASK;
-	if (register_id_scan(&b->common.uid,scan,st->st_uid)) GOTOERROR;
-	if (register_id_scan(&b->common.gid,scan,st->st_gid)) GOTOERROR;
-	b->common.mtime=st->st_mtim.tv_sec;
-	b->major=major(st->st_rdev);
-	b->minor=minor(st->st_rdev);
-
-	if (!(inode=new_inode(scan,st,BDEV_TYPE_SCAN,b))) GOTOERROR;
-
 	b->common.inode=inode;
 }
 
@@ -196,9 +335,8 @@ de->type=BDEV_TYPE_SCAN;
 de->bdev=b;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
-(void)add_sort_dirent_scan(&directory->entries.top,de);
+(void)adddirent(directory,de);
 
-// scan->counts.namelens+=de->filenamelen; // devices aren't stored in range
 return 0;
 error:
 	return -1;
@@ -218,29 +356,24 @@ if (dir) {
 if (fstat(fd,&st)) GOTOERROR;
 
 directory->linkcount+=1;
-scan->counts.files+=1;
-if (scan->counts.files==scan->config.maxfiles) GOTOERROR;
-
-inode=find_sort_inode_scan(scan->inodes.top,st.st_ino,st.st_dev);
-if (inode) {
+if (countfile(scan)) GOTOERROR;
+
+if (!(l=S_MAPMEM(&scan->mapmem,struct symlink_scan))) GOTOERROR;
+clear_symlink_scan(l);
+l->common.mode=st.st_mode&MODEMASK;
+if (register_id_scan(&l->common.uid,scan,st.st_uid)) GOTOERROR;
+if (register_id_scan(&l->common.gid,scan,st.st_gid)) GOTOERROR;
+l->common.mtime=st.st_mtim.tv_sec;
+l->size=st.st_size;
+
+if (!(inode=new_inode(scan,&st,SYMLINK_TYPE_SCAN,l))) GOTOERROR;
+if (inode->vptr!=l) { // hardlink
 	if (inode->type!=SYMLINK_TYPE_SCAN) GOTOERROR;
-	inode->hardlinkcount+=1;
 	l=inode->symlink;
 } else {
-	if (!(l=S_MAPMEM(&scan->mapmem,struct symlink_scan))) GOTOERROR;
-	clear_symlink_scan(l);
-
-	l->common.mode=st.st_mode&MODEMASK;
-	if (register_id_scan(&l->common.uid,scan,st.st_uid)) GOTOERROR;
-	if (register_id_scan(&l->common.gid,scan,st.st_gid)) GOTOERROR;
-	l->common.mtime=st.st_mtim.tv_sec;
-	l->size=st.st_size;
 	if (!(l->pointer=alloc_mapmem(&scan->mapmem,l->size+1))) GOTOERROR;
 	l->pointer[l->size]='\0';
 	if (0>readlinkat(fd,"",l->pointer,l->size)) GOTOERROR;
-
-	if (!(inode=new_inode(scan,&st,SYMLINK_TYPE_SCAN,l))) GOTOERROR;
-
 	l->common.inode=inode;
 }
 
@@ -252,9 +385,8 @@ de->type=SYMLINK_TYPE_SCAN;
 de->symlink=l;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
-(void)add_sort_dirent_scan(&directory->entries.top,de);
+(void)adddirent(directory,de);
 
-// scan->counts.namelens+=de->filenamelen; // symlinks aren't stored in range
 (ignore)close(fd);
 return 0;
 error:
@@ -263,64 +395,121 @@ error:
 }
 
 static void markisnotzero(struct scan *scan, struct directory_scan *d) {
+if (scan->worker) { // parents belong to other workers, they're marked after join
+	d->isnotzero=1;
+	return;
+}
 do {
 	if (d->isnotzero) return;
 	d->isnotzero=1;
-	scan->counts.namelens+=d->namelens;
 	d=d->parent;
 } while (d);
 }
 
+static int listextents(unsigned int *count_out, struct extent_scan *list, unsigned int max, int fd, uint64_t size) {
+// counts all data extents, fills list with up to max of them
+unsigned int count=0;
+uint64_t offset=0;
+while (offset<size) {
+	off_t data,hole;
+	if (0>(data=lseek(fd,offset,SEEK_DATA))) {
+		if (errno==ENXIO) break; // the rest is a hole
+		GOTOERROR; // e.g., EINVAL if the fs doesn't support it
+	}
+	if (0>(hole=lseek(fd,data,SEEK_HOLE))) GOTOERROR;
+	if (hole>size) hole=size;
+	if (data>=hole) break;
+	if (count<max) {
+		list[count].start=data;
+		list[count].end=hole;
+	}
+	count+=1;
+	offset=hole;
+}
+*count_out=count;
+return 0;
+error:
+	return -1;
+}
+
+static int findextents(struct file_scan *f, struct scan *scan, int dirfd, char *filename, char *overlay) {
+// holes are only noticed, not finding them isn't an error
+struct extent_scan first;
+unsigned int count,count2;
+int fd=-1;
+
+if (overlay) fd=open(overlay,O_RDONLY);
+else fd=openat(dirfd,filename,O_RDONLY);
+if (fd<0) return 0;
+if (listextents(&count,&first,1,fd,f->size)) goto done;
+if ((count==1) && (!first.start) && (first.end==f->size)) goto done; // no holes after all
+if (count) {
+	if (!(f->extents=alloc_mapmem(&scan->mapmem,count*sizeof(struct extent_scan)))) GOTOERROR;
+	if (listextents(&count2,f->extents,count,fd,f->size)) goto done;
+	if (count2<count) count=count2; // file changed between passes
+}
+f->extentcount=count;
+f->issparse=1;
+scan->counts.extents+=count;
+done:
+(ignore)close(fd);
+return 0;
+error:
+	ignore_ifclose(fd);
+	return -1;
+}
+
+int isholeblock_scan(unsigned int *cursor_inout, struct file_scan *f, uint64_t start, uint64_t end) {
+// 1 if [start,end) of a sparse file has no data, call this with increasing start values
+unsigned int ui=*cursor_inout;
+while ((ui<f->extentcount) && (f->extents[ui].end<=start)) ui++;
+*cursor_inout=ui;
+if (ui==f->extentcount) return 1;
+if (f->extents[ui].start>=end) return 1;
+return 0;
+}
+
 static int addfile_directory_scan(struct directory_scan *directory, struct scan *scan, struct stat *st,
-		char *filename, char *overlay) {
+		int dirfd, char *filename, char *overlay) {
 struct dirent_scan *de;
 struct file_scan *f;
 struct inode_scan *inode;
 
 directory->linkcount+=1;
-scan->counts.files+=1;
-if (scan->counts.files==scan->config.maxfiles) GOTOERROR;
-
-inode=find_sort_inode_scan(scan->inodes.top,st->st_ino,st->st_dev);
-if (inode) {
+if (countfile(scan)) GOTOERROR;
+
+if (!(f=S_MAPMEM(&scan->mapmem,struct file_scan))) GOTOERROR;
+clear_file_scan(f);
+f->common.mode=st->st_mode&MODEMASK;
+if (register_id_scan(&f->common.uid,scan,st->st_uid)) GOTOERROR;
+if (register_id_scan(&f->common.gid,scan,st->st_gid)) GOTOERROR;
+f->common.mtime=st->st_mtim.tv_sec;
+f->mtimensec=st->st_mtim.tv_nsec;
+f->size=st->st_size;
+
+if (!(inode=new_inode(scan,st,FILE_TYPE_SCAN,f))) GOTOERROR;
+if (inode->vptr!=f) { // hardlink, other workers only read .size until the scan is done
 	if (inode->type!=FILE_TYPE_SCAN) GOTOERROR;
-	inode->hardlinkcount+=1;
 	f=inode->file;
 } else {
-	if (!(f=S_MAPMEM(&scan->mapmem,struct file_scan))) GOTOERROR;
-	clear_file_scan(f);
-	f->common.mode=st->st_mode&MODEMASK;
-	if (register_id_scan(&f->common.uid,scan,st->st_uid)) GOTOERROR;
-	if (register_id_scan(&f->common.gid,scan,st->st_gid)) GOTOERROR;
-	f->common.mtime=st->st_mtim.tv_sec;
-	f->size=st->st_size;
-
-	if (f->size && (!overlay)) {
-		(void)markisnotzero(scan,directory);
-		scan->counts.non0files+=1;
-	}
-
-	if (!(inode=new_inode(scan,st,FILE_TYPE_SCAN,f))) GOTOERROR;
-
 	f->common.inode=inode;
+	if (f->size) scan->counts.non0files+=1;
+	if (S_ISREG(st->st_mode) && ((uint64_t)st->st_blocks*512 < f->size)) { // fewer blocks than bytes, maybe it has holes
+		if (findextents(f,scan,dirfd,filename,overlay)) GOTOERROR;
+	}
 }
 
 if (!(de=S_MAPMEM(&scan->mapmem,struct dirent_scan))) GOTOERROR;
 clear_dirent_scan(de);
 de->filenamelen=strlen(filename);
+if (f->size && (!overlay)) (void)markisnotzero(scan,directory); // any hardlink could be the one range uses
 if (!(de->filename=strdup3_mapmem(&scan->mapmem,filename,de->filenamelen))) GOTOERROR;
 de->type=FILE_TYPE_SCAN;
 de->file=f;
 de->overlay=overlay;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
-(void)add_sort_dirent_scan(&directory->entries.top,de);
-
-// this is for range
-if (f->size) {
-	if (overlay) scan->counts.namelens+=strlen(overlay)+1;
-	else scan->counts.namelens+=de->filenamelen+1;
-}
+(void)adddirent(directory,de);
 return 0;
 error:
 	return -1;
@@ -332,9 +521,6 @@ struct dirent_scan *de;
 struct directory_scan *d;
 struct inode_scan *inode;
 
-inode=find_sort_inode_scan(scan->inodes.top,st->st_ino,st->st_dev);
-if (inode) GOTOERROR; // this happens if we have a directory loop
-
 directory->linkcount+=1;
 scan->counts.subdirs+=1;
 
@@ -351,6 +537,7 @@ if (register_id_scan(&d->common.gid,scan,st->st_gid)) GOTOERROR;
 d->common.mtime=st->st_mtim.tv_sec;
 
 if (!(inode=new_inode(scan,st,DIRECTORY_TYPE_SCAN,d))) GOTOERROR;
+if (inode->vptr!=d) GOTOERROR; // this happens if we have a directory loop
 
 d->common.inode=inode;
 
@@ -363,12 +550,7 @@ de->directory=d;
 de->overlay=overlay;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
-(void)add_sort_dirent_scan(&directory->entries.top,de);
-
-// this is for range, this space will be unused if it ends up being !.isnotzero
-d->namelens=de->filenamelen+1;
-if (overlay) d->namelens+=strlen(overlay)+1;
-// scan->counts.namelens+=de->filenamelen+1;
+(void)adddirent(directory,de);
 
 *d_out=d;
 return 0;
@@ -379,6 +561,30 @@ error:
 static int add_dir(unsigned int *curdepth_inout, struct scan *scan, DIR *dir, struct directory_scan *directory,
 		struct options *options);
 
+static int addjob(struct worker_scan *w, char *filename, struct directory_scan *d, unsigned int depth) {
+// d will be read by whichever worker is free
+struct shared_scan *shared=w->shared;
+struct job_scan *job;
+unsigned int len,len2;
+len=strlen(w->path);
+len2=strlen(filename);
+if (!(job=malloc(sizeof(struct job_scan)+len+len2+2))) GOTOERROR;
+job->directory=d;
+job->depth=depth;
+job->path=(char *)(job+1);
+memcpy(job->path,w->path,len);
+job->path[len]='/';
+memcpy(job->path+len+1,filename,len2+1);
+(ignore)pthread_mutex_lock(&shared->mutex);
+job->next=shared->jobs;
+shared->jobs=job;
+(ignore)pthread_cond_signal(&shared->cond);
+(ignore)pthread_mutex_unlock(&shared->mutex);
+return 0;
+error:
+	return -1;
+}
+
 static int addsubdir(unsigned int *curdepth_inout, struct scan *scan, DIR *parentdir, char *filename, struct directory_scan *d,
 		struct options *options) {
 int fd=-1;
@@ -449,8 +655,182 @@ deptr=&directory->entries.first;
 (void)setlinearvars(scan,&deptr,directory->entries.top);
 }
 
+static int addentry(unsigned int *curdepth_inout, struct scan *scan, DIR *dir, struct directory_scan *directory,
+		unsigned char type, char *filename, struct stat *st, struct options *options) {
+switch (type) {
+	case DT_REG:
+		if (addfile_directory_scan(directory,scan,st,dirfd(dir),filename,NULL)) GOTOERROR;
+		break;
+	case DT_DIR:
+		{
+			struct directory_scan *d;
+			if (adddirectory_directory_scan(&d,directory,scan,st,filename,NULL)) GOTOERROR;
+			if (scan->worker) {
+				if (addjob(scan->worker,filename,d,*curdepth_inout)) GOTOERROR;
+			} else {
+				if (addsubdir(curdepth_inout,scan,dir,filename,d,options)) GOTOERROR;
+			}
+		}
+		break;
+	case DT_BLK:
+		if (addbdev_directory_scan(directory,scan,st,filename)) GOTOERROR;
+		break;
+	case DT_CHR:
+		if (addcdev_directory_scan(directory,scan,st,filename)) GOTOERROR;
+		break;
+}
+return 0;
+error:
+	return -1;
+}
+
+static struct uring *newuring(void) {
+#ifdef HAVEIOURING
+struct uring *u;
+if (!(u=malloc(sizeof(struct uring)))) return NULL;
+if (init_uring(u,BATCH_STATX)) { // e.g., an old kernel or seccomp, fstatat still works
+	free(u);
+	return NULL;
+}
+return u;
+#else
+return NULL;
+#endif
+}
+
+static void freeuring(struct uring *u) {
+#ifdef HAVEIOURING
+if (!u) return;
+(void)deinit_uring(u);
+free(u);
+#endif
+}
+
+#ifdef HAVEIOURING
+struct statx_scan { // a directory entry waiting on its statx
+	unsigned char type; // DT_
+	int res;
+	struct statx stx;
+	char name[256];
+};
+
+static int addstatx(unsigned int *curdepth_inout, struct scan *scan, DIR *dir, struct directory_scan *directory,
+		struct statx_scan *one, struct options *options) {
+struct stat st;
+if (one->res<0) { // e.g., the kernel is too old for statx in io_uring, fstatat gives the real error
+	if (fstatat(dirfd(dir),one->name,&st,0)) {
+		syslog(LOG_ERR,"stat error: %s %s",one->name,strerror(errno));
+		GOTOERROR;
+	}
+} else {
+	memset(&st,0,sizeof(st));
+	st.st_mode=one->stx.stx_mode;
+	st.st_ino=one->stx.stx_ino;
+	st.st_nlink=one->stx.stx_nlink;
+	st.st_dev=makedev(one->stx.stx_dev_major,one->stx.stx_dev_minor);
+	st.st_rdev=makedev(one->stx.stx_rdev_major,one->stx.stx_rdev_minor);
+	st.st_uid=one->stx.stx_uid;
+	st.st_gid=one->stx.stx_gid;
+	st.st_size=one->stx.stx_size;
+	st.st_blocks=one->stx.stx_blocks;
+	st.st_mtim.tv_sec=one->stx.stx_mtime.tv_sec;
+	st.st_mtim.tv_nsec=one->stx.stx_mtime.tv_nsec;
+}
+if (addentry(curdepth_inout,scan,dir,directory,one->type,one->name,&st,options)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int drainbatch(struct scan *scan, unsigned int inflight) {
+// after a failed submit, waits until the kernel is done with what it has of the batch
+// if that fails too, the ring is dropped and the caller has to leave the batch alone
+uint64_t userdata;
+int res;
+while (inflight) {
+	if (getcqe_uring(&userdata,&res,scan->uring)) { inflight-=1; continue; }
+	if (reap_uring(scan->uring)) {
+		syslog(LOG_ERR,"Unable to wait on io_uring (%s), abandoning the batch",strerror(errno));
+		(void)freeuring(scan->uring);
+		scan->uring=NULL;
+		return -1;
+	}
+}
+return 0;
+}
+
+static int statbatch(unsigned int *curdepth_inout, struct scan *scan, DIR *dir, struct directory_scan *directory,
+		struct statx_scan *batch, unsigned int count, struct options *options) {
+// submits statx for the whole batch, entries are added as they complete
+// subdirectories wait until the ring is empty, in case add_dir recurses and reuses it
+struct uring *uring=scan->uring;
+unsigned int ui,inflight=0;
+int iserror=0;
+
+for (ui=0;ui<count;ui++) {
+	struct io_uring_sqe *sqe;
+	if (!(sqe=getsqe_uring(uring))) { // shouldn't happen, the ring is at least BATCH_STATX
+		batch[ui].res=-EAGAIN;
+		continue;
+	}
+	sqe->opcode=IORING_OP_STATX;
+	sqe->fd=dirfd(dir);
+	sqe->addr=(uint64_t)(uintptr_t)batch[ui].name;
+	sqe->len=MASK_STATX;
+	sqe->off=(uint64_t)(uintptr_t)&batch[ui].stx;
+	sqe->user_data=ui;
+	inflight+=1;
+}
+while (inflight) {
+	uint64_t userdata;
+	int res;
+	if (!getcqe_uring(&userdata,&res,uring)) {
+		if (wait_uring(uring)) { // a failed enter submits nothing, the unsubmitted sqes are still counted in .pending
+			(ignore)drainbatch(scan,inflight-uring->pending);
+			GOTOERROR;
+		}
+		continue;
+	}
+	inflight-=1;
+	batch[userdata].res=res;
+	if (iserror || (batch[userdata].type==DT_DIR)) continue;
+	if (addstatx(curdepth_inout,scan,dir,directory,&batch[userdata],options)) iserror=1; // keep reaping, the kernel has pointers to batch
+}
+if (iserror) GOTOERROR;
+for (ui=0;ui<count;ui++) {
+	if (batch[ui].type!=DT_DIR) continue;
+	if (addstatx(curdepth_inout,scan,dir,directory,&batch[ui],options)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+#endif
+
+static void throttle(struct scan *scan) {
+// sleeps as needed to keep readdir() and stat() to .config.maxrate entries per second
+struct timespec now;
+uint64_t due,elapsed;
+if (clock_gettime(CLOCK_MONOTONIC,&now)) return;
+if (!scan->throttle.count) scan->throttle.start=now;
+scan->throttle.count+=1;
+due=(scan->throttle.count*1000000000)/scan->config.maxrate;
+elapsed=(now.tv_sec-scan->throttle.start.tv_sec)*(uint64_t)1000000000+now.tv_nsec-scan->throttle.start.tv_nsec;
+if (due>elapsed+1000000) { // sleeping for less than a msec isn't worth it
+	struct timespec ts;
+	due-=elapsed;
+	ts.tv_sec=due/1000000000;
+	ts.tv_nsec=due%1000000000;
+	(ignore)nanosleep(&ts,NULL);
+}
+}
+
 static int add_dir(unsigned int *curdepth_inout, struct scan *scan, DIR *dir, struct directory_scan *directory,
 		struct options *options) {
+#ifdef HAVEIOURING
+struct statx_scan *batch=NULL;
+unsigned int batchcount=0;
+#endif
 struct dirent *dirent;
 int fd;
 
@@ -458,45 +838,52 @@ int fd;
 if (*curdepth_inout > scan->counts.maxdepth) scan->counts.maxdepth=*curdepth_inout;
 
 fd=dirfd(dir);
+directory->islisting=1;
+#ifdef HAVEIOURING
+if (scan->uring) {
+	if (!(batch=malloc(BATCH_STATX*sizeof(struct statx_scan)))) GOTOERROR;
+}
+#endif
 
 while (1) {
 	struct stat st;
 
+	if (scan->config.maxrate) (void)throttle(scan);
 	errno=0;
 	dirent=readdir(dir);
 	if (!dirent) break;
 
 	switch (dirent->d_type) {
-		case DT_REG:
-			if (fstatat(fd,dirent->d_name,&st,0)) {
-				syslog(LOG_ERR,"stat error: %s %s",dirent->d_name,strerror(errno));
-				GOTOERROR;
-			}
-			if (addfile_directory_scan(directory,scan,&st,dirent->d_name,NULL)) GOTOERROR;
-			break;
 		case DT_DIR:
 			if (dirent->d_name[0]=='.') {
 					if (!dirent->d_name[1]) continue;
 					if ((dirent->d_name[1]=='.')&&(!dirent->d_name[2])) continue;
 			}
-			if (fstatat(fd,dirent->d_name,&st,0)) GOTOERROR;
-			{
-				struct directory_scan *d;
-				if (adddirectory_directory_scan(&d,directory,scan,&st,dirent->d_name,NULL)) GOTOERROR;
-				if (addsubdir(curdepth_inout,scan,dir,dirent->d_name,d,options)) GOTOERROR;
+			// fall through
+		case DT_REG:
+		case DT_BLK:
+		case DT_CHR:
+#ifdef HAVEIOURING
+			if (batch) {
+				batch[batchcount].type=dirent->d_type;
+				strcpy(batch[batchcount].name,dirent->d_name);
+				batchcount+=1;
+				if (batchcount==BATCH_STATX) {
+					if (statbatch(curdepth_inout,scan,dir,directory,batch,batchcount,options)) GOTOERROR;
+					batchcount=0;
+				}
+				break;
+			}
+#endif
+			if (fstatat(fd,dirent->d_name,&st,0)) {
+				syslog(LOG_ERR,"stat error: %s %s",dirent->d_name,strerror(errno));
+				GOTOERROR;
 			}
+			if (addentry(curdepth_inout,scan,dir,directory,dirent->d_type,dirent->d_name,&st,options)) GOTOERROR;
 			break;
 		case DT_LNK: 
 			if (addsymlink_directory_scan(directory,scan,dir,dirent->d_name,NULL)) GOTOERROR;
 			break;
-		case DT_BLK:
-			if (fstatat(fd,dirent->d_name,&st,0)) GOTOERROR;
-			if (addbdev_directory_scan(directory,scan,&st,dirent->d_name)) GOTOERROR;
-			break;
-		case DT_CHR:
-			if (fstatat(fd,dirent->d_name,&st,0)) GOTOERROR;
-			if (addcdev_directory_scan(directory,scan,&st,dirent->d_name)) GOTOERROR;
-			break;
 		case DT_FIFO:
 			if (options->isdebug) {
 				syslog(LOG_DEBUG,"Ignoring fifo: %s",dirent->d_name);
@@ -515,6 +902,185 @@ while (1) {
 	}
 }
 if (errno) GOTOERROR;
+#ifdef HAVEIOURING
+if (batchcount) {
+	if (statbatch(curdepth_inout,scan,dir,directory,batch,batchcount,options)) GOTOERROR;
+}
+#endif
+directory->islisting=0;
+if (fromlist_sort_dirent_scan(&directory->entries.top,directory->entries.first)) GOTOERROR;
+directory->entries.first=NULL;
+#ifdef HAVEIOURING
+iffree(batch);
+#endif
+return 0;
+error:
+#ifdef HAVEIOURING
+	if (scan->uring) iffree(batch); // else statbatch() gave up on the ring and the kernel may still write to batch
+#endif
+	return -1;
+}
+
+static int readjob(struct worker_scan *w, struct job_scan *job) {
+unsigned int curdepth;
+DIR *dir=NULL;
+int fd;
+if (0>(fd=open(job->path,OPENDIRFLAGS))) GOTOERROR;
+if (!(dir=fdopendir(fd))) { (ignore)close(fd); GOTOERROR; }
+w->path=job->path;
+curdepth=job->depth;
+if (add_dir(&curdepth,&w->scan,dir,job->directory,w->shared->options)) GOTOERROR;
+(ignore)closedir(dir);
+return 0;
+error:
+	if (dir) closedir(dir);
+	return -1;
+}
+
+static void *worker_thread(void *arg) {
+struct worker_scan *w=(struct worker_scan*)arg;
+struct shared_scan *shared=w->shared;
+(ignore)pthread_mutex_lock(&shared->mutex);
+while (!shared->iserror) {
+	struct job_scan *job;
+	int r;
+	if (!(job=shared->jobs)) {
+		if (!shared->busy) break; // no one is left to add jobs
+		(ignore)pthread_cond_wait(&shared->cond,&shared->mutex);
+		continue;
+	}
+	shared->jobs=job->next;
+	shared->busy+=1;
+	(ignore)pthread_mutex_unlock(&shared->mutex);
+	r=readjob(w,job);
+	free(job);
+	(ignore)pthread_mutex_lock(&shared->mutex);
+	shared->busy-=1;
+	if (r) shared->iserror=1;
+	if (r || (!shared->busy && !shared->jobs)) (ignore)pthread_cond_broadcast(&shared->cond);
+}
+(ignore)pthread_mutex_unlock(&shared->mutex);
+return NULL;
+}
+
+static int mergelinks(struct links_scan *dest, struct links_scan *src) {
+unsigned int ui;
+if (!src->slots) return 0;
+for (ui=0;ui<=src->mask;ui++) {
+	struct inode_scan *found;
+	if (!src->slots[ui]) continue;
+	if (findadd_inode(&found,dest,src->slots[ui])) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int marknotzero(struct directory_scan *d);
+static int marknotzero_entries(struct dirent_scan *de) {
+int r=0;
+if (de->treevars.left) r|=marknotzero_entries(de->treevars.left);
+if (de->type==DIRECTORY_TYPE_SCAN) r|=marknotzero(de->directory);
+if (de->treevars.right) r|=marknotzero_entries(de->treevars.right);
+return r;
+}
+static int marknotzero(struct directory_scan *d) {
+// workers only mark the directory they read, this marks the parents
+if (d->entries.top && marknotzero_entries(d->entries.top)) d->isnotzero=1;
+return d->isnotzero;
+}
+
+static int addthreaded(struct scan *scan, char *dirname, unsigned int numthreads, struct options *options) {
+// workers read one directory at a time, subdirectories are queued for any worker
+struct shared_scan *shared=NULL;
+struct worker_scan *workers=NULL;
+struct job_scan *job;
+unsigned int started=0,ui;
+int iserror=0;
+
+if (!(shared=ZTMALLOC(1,struct shared_scan))) GOTOERROR;
+shared->main=scan;
+shared->options=options;
+if (pthread_mutex_init(&shared->mutex,NULL)) { free(shared); GOTOERROR; }
+(ignore)pthread_mutex_init(&shared->idmutex,NULL);
+(ignore)pthread_cond_init(&shared->cond,NULL);
+for (ui=0;ui<SHARDS_SCAN;ui++) (ignore)pthread_mutex_init(&shared->shards[ui].mutex,NULL);
+
+if (!(job=malloc(sizeof(struct job_scan)+strlen(dirname)+1))) goto stop;
+job->directory=&scan->rootdir.directory;
+job->depth=0;
+job->path=(char *)(job+1);
+strcpy(job->path,dirname);
+job->next=NULL;
+shared->jobs=job;
+
+if (!(workers=ZTMALLOC(numthreads,struct worker_scan))) goto stop;
+for (ui=0;ui<numthreads;ui++) {
+	struct worker_scan *w=&workers[ui];
+	w->shared=shared;
+	w->scan.config=scan->config;
+	if (scan->config.maxrate) { // each worker gets its share, so they don't need a shared clock
+		w->scan.config.maxrate=scan->config.maxrate/numthreads;
+		if (!w->scan.config.maxrate) w->scan.config.maxrate=1;
+	}
+	w->scan.worker=w;
+	w->scan.uring=newuring();
+	if (init2_mapmem(&w->scan.mapmem,scan->config.mapsize,scan->config.spilldir)) goto stop;
+}
+(ignore)pthread_mutex_lock(&shared->mutex);
+for (ui=0;ui<numthreads;ui++) {
+	if (pthread_create(&workers[ui].thread,NULL,worker_thread,&workers[ui])) break;
+	started+=1;
+}
+if (!started) shared->iserror=1;
+(ignore)pthread_mutex_unlock(&shared->mutex);
+goto done;
+stop:
+	WHEREAMI;
+	iserror=1;
+done:
+	for (ui=0;ui<started;ui++) (ignore)pthread_join(workers[ui].thread,NULL);
+	if (shared->iserror) iserror=1;
+	while ((job=shared->jobs)) {
+		shared->jobs=job->next;
+		free(job);
+	}
+	if (workers) {
+		for (ui=0;ui<numthreads;ui++) {
+			struct scan *w=&workers[ui].scan;
+			(void)freeuring(w->uring);
+			if (w->inodes.first) {
+				struct inode_scan *last;
+				for (last=w->inodes.first;last->next;last=last->next);
+				last->next=scan->inodes.first;
+				scan->inodes.first=w->inodes.first;
+			}
+			// everything was allocated in the workers' arenas, deinit_scan frees it all
+			(void)merge_mapmem(&scan->mapmem,&w->mapmem);
+			scan->counts.files+=w->counts.files;
+			scan->counts.non0files+=w->counts.non0files;
+			scan->counts.extents+=w->counts.extents;
+			scan->counts.subdirs+=w->counts.subdirs;
+			scan->counts.inodes+=w->counts.inodes;
+			if (w->counts.maxdepth>scan->counts.maxdepth) scan->counts.maxdepth=w->counts.maxdepth;
+		}
+		free(workers);
+	}
+	if (!iserror) {
+		for (ui=0;ui<SHARDS_SCAN;ui++) {
+			if (mergelinks(&scan->inodes.links,&shared->shards[ui].links)) { iserror=1; break; }
+		}
+		(ignore)marknotzero(&scan->rootdir.directory);
+	}
+	for (ui=0;ui<SHARDS_SCAN;ui++) {
+		iffree(shared->shards[ui].links.slots);
+		(ignore)pthread_mutex_destroy(&shared->shards[ui].mutex);
+	}
+	(ignore)pthread_cond_destroy(&shared->cond);
+	(ignore)pthread_mutex_destroy(&shared->idmutex);
+	(ignore)pthread_mutex_destroy(&shared->mutex);
+	free(shared);
+if (iserror) GOTOERROR;
 return 0;
 error:
 	return -1;
@@ -543,7 +1109,6 @@ scan->rootdir.path="";
 
 d=&scan->rootdir.directory;
 if (fillfakedir(scan,d,NULL)) GOTOERROR;
-d->namelens=1; // we may need this if overlay is added (probably)
 
 return 0;
 error:
@@ -556,16 +1121,23 @@ struct stat st;
 int fd=-1;
 struct directory_scan *d;
 struct inode_scan *inode;
-unsigned int curdepth=0;
+unsigned int curdepth=0,numthreads;
 
 if (!*dirname) return setnorootdir_scan(scan,options);
 
+numthreads=scan->config.threads;
+if (!numthreads) {
+	long l;
+	l=sysconf(_SC_NPROCESSORS_ONLN);
+	numthreads=(l>0)?(unsigned int)l:1;
+}
+if (numthreads>MAXTHREADS_SCAN) numthreads=MAXTHREADS_SCAN;
+
 if (0>(fd=open(dirname,OPENDIRFLAGS))) GOTOERROR;
 if (fstat(fd,&st)) GOTOERROR;
 if (!(dir=fdopendir(fd))) GOTOERROR;
 fd=-1;
-scan->rootdir.path=dirname;
-scan->counts.namelens+=strlen(dirname)+1;
+scan->rootdir.path=dirname; // this is kept by the export, range can point to it
 
 d=&scan->rootdir.directory;
 
@@ -580,7 +1152,11 @@ d->common.mtime=st.st_mtim.tv_sec;
 if (!(inode=pseudo_inode(scan,DIRECTORY_TYPE_SCAN,d))) GOTOERROR;
 d->common.inode=inode;
 
-if (add_dir(&curdepth,scan,dir,&scan->rootdir.directory,options)) GOTOERROR;
+if (numthreads>1) {
+	if (addthreaded(scan,dirname,numthreads,options)) GOTOERROR;
+} else {
+	if (add_dir(&curdepth,scan,dir,&scan->rootdir.directory,options)) GOTOERROR;
+}
 
 (ignore)closedir(dir);
 return 0;
@@ -596,16 +1172,26 @@ return 0;
 }
 #endif
 
-int init_scan(struct scan *scan, unsigned int mapsize, unsigned int maxfiles) {
-if (init_mapmem(&scan->mapmem,mapsize)) GOTOERROR;
+int init_scan(struct scan *scan, unsigned int mapsize, unsigned int maxfiles, unsigned int threads, char *spilldir) {
+if (init2_mapmem(&scan->mapmem,mapsize,spilldir)) GOTOERROR;
 scan->rootdir.directory.linkcount=1; // TODO should this be 1 or 2?
+scan->config.mapsize=mapsize;
 scan->config.maxfiles=maxfiles;
+scan->config.threads=threads;
+scan->config.spilldir=spilldir;
+scan->uring=newuring();
 return 0;
 error:
 	return -1;
 }
 
+void setmaxrate_scan(struct scan *scan, unsigned int maxrate) {
+scan->config.maxrate=maxrate;
+}
+
 void deinit_scan(struct scan *scan) {
+(void)freeuring(scan->uring);
+iffree(scan->inodes.links.slots);
 deinit_mapmem(&scan->mapmem);
 }
 
@@ -631,7 +1217,6 @@ de->directory=d;
 de->treevars.balance=0;
 de->treevars.left= de->treevars.right= de->next= NULL;
 (void)add_sort_dirent_scan(&parent->entries.top,de);
-d->namelens=namelen+1;
 return d;
 error:
 	return NULL;
@@ -698,7 +1283,7 @@ switch (st.st_mode&S_IFMT) {
 		if (addsymlink_directory_scan(d,scan,NULL,fakebase,realpath)) GOTOERROR;
 		break;
 	case S_IFREG:
-		if (addfile_directory_scan(d,scan,&st,fakebase,realpath)) GOTOERROR;
+		if (addfile_directory_scan(d,scan,&st,-1,fakebase,realpath)) GOTOERROR;
 		break;
 	case S_IFDIR:
 		{
@@ -714,7 +1299,7 @@ switch (st.st_mode&S_IFMT) {
 			uint64_t u64;
 			if (0>getsize_blockdevice(&u64,realpath)) GOTOERROR;
 			st.st_size=u64;
-			if (addfile_directory_scan(d,scan,&st,fakebase,realpath)) GOTOERROR;
+			if (addfile_directory_scan(d,scan,&st,-1,fakebase,realpath)) GOTOERROR;
 		}
 		break;
 	case S_IFCHR:
@@ -50,14 +50,17 @@ struct inode_scan { // this is a _real_ inode, from underlying fs
 
 	uint64_t dataoffset; // full offset for first data block, less than 96 means undefined
 
-	unsigned int blocksoffset; // offset of metablock in inode table
+	unsigned int blockindex; // metablock in inode table, mkfs turns this into an offset
 	unsigned short offsetinblock; // offset of inode within metablock
 
 	uint32_t hardlinkcount;
-	struct {
-		signed char balance;
-		struct inode_scan *left,*right;
-	} treevars;
+	struct inode_scan *next; // in scan.inodes.first
+};
+
+struct links_scan { // (dev,ino) => inode, open addressing
+	struct inode_scan **slots;
+	unsigned int mask; // slot count-1, 0 => no slots yet
+	unsigned int count;
 };
 
 
@@ -70,16 +73,25 @@ struct common_scan {
 	unsigned int dirpeers; // this many directory entries follow a header (max: 256)
 };
 
+struct dirindex_scan { // lets the client skip to the right metablock of a large directory
+	uint32_t index; // offset of a directory header, from the start of the listing
+	uint32_t start; // the header's metablock in directory table, its offset is patched in by mkfs
+	char *name; // first name after the header
+	unsigned int namelen;
+};
+
 struct directory_scan {
 	struct common_scan common;
 	uint32_t linkcount;
 
 	unsigned int tablesize; // size of directory in directory table
-	unsigned int blocksoffset; // offset of directory header in directory table
+	unsigned int blockindex; // metablock of directory header in directory table
 	unsigned short offsetinblock; // offset of directory header in directory table
+	unsigned int indexcount;
+	struct dirindex_scan *index; // one per metablock the listing crosses
 
-	unsigned short namelens;
 	int isnotzero:1; // a directory only needs to be stored in range if it has nonzero files
+	int islisting:1; // add_dir is reading it, new entries are chained on .entries.first until it's sorted
 
 	struct directory_scan *parent;
 
@@ -89,9 +101,24 @@ struct directory_scan {
 	} entries;
 };
 
+struct extent_scan {
+	uint64_t start,end; // bytes with data, everything else is a hole
+};
+
 struct file_scan {
 	struct common_scan common;
 	uint64_t size; // of underlying data
+	uint32_t mtimensec; // with .common.mtime, store uses this to notice rewrites
+	int issparse:1; // the file has holes, .extents lists where the data is
+	unsigned int extentcount;
+	struct extent_scan *extents;
+	struct file_store *store; // compressed blocks, NULL or .israw => use the file as-is
+	int isfragment:1; // the tail (size%blocksize) is packed in fragment .fragindex at .fragoffset
+	uint32_t fragindex,fragoffset;
+	struct file_scan *dupof; // same contents as this file, share its data
+	unsigned int dedupindex; // for dedup, 1+index of the candidate
+	int isplaced:1; // data is in range, starting at .blocksstart
+	uint64_t blocksstart;
 };
 
 struct symlink_scan {
@@ -134,12 +161,20 @@ struct dirent_scan {
 struct scan {
 	struct mapmem mapmem;
 	struct {
+		unsigned int mapsize; // also for workers' arenas
 		unsigned int maxfiles;
+		unsigned int threads; // for the root directory, 0 => one per cpu
+		char *spilldir; // NULL => arenas are anonymous memory
+		unsigned int maxrate; // directory entries per second, 0 => as fast as possible
 	} config;
+	struct {
+		struct timespec start;
+		uint64_t count;
+	} throttle; // for .config.maxrate
 	struct {
 		unsigned int files,non0files;
+		unsigned int extents; // in sparse files, these can each need a range entry
 		unsigned int subdirs;
-		unsigned int namelens; // lens for files and subdirs that are (isnonzero)
 		unsigned int maxdepth;
 		unsigned int inodes; // note .counts.inodes vs .inodes.count, this is first count, before assignment
 	} counts;
@@ -152,14 +187,19 @@ struct scan {
 		uint32_t count;
 	} ids;
 	struct {
-		struct inode_scan *top;
+		struct inode_scan *first; // every real inode, pseudo inodes aren't listed
+		struct links_scan links; // inodes that can be found again: hardlinks and directories
 		uint32_t count;
 	} inodes;
+	struct worker_scan *worker; // set in a worker's copy, during a threaded scan
+	struct uring *uring; // NULL => stat entries one at a time
 };
 
-int init_scan(struct scan *scan, unsigned int mapsize, unsigned int maxfiles);
+int init_scan(struct scan *scan, unsigned int mapsize, unsigned int maxfiles, unsigned int threads, char *spilldir);
+void setmaxrate_scan(struct scan *scan, unsigned int maxrate);
 void deinit_scan(struct scan *scan);
 int setrootdir_scan(struct scan *scan, char *dirname, struct options *options);
 int setnorootdir_scan(struct scan *scan, struct options *options);
 void setlinearvars_scan(struct scan *scan, struct directory_scan *directory);
+int isholeblock_scan(unsigned int *cursor_inout, struct file_scan *f, uint64_t start, uint64_t end);
 int applyoverlay_scan(struct scan *scan, char *realpath_in, char *fakepath_in, int israw, struct options *options);
@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <syslog.h>
 #include "common/conventions.h"
 #include "common/mapmem.h"
 #include "options.h"
@@ -146,10 +147,77 @@ void add_sort_dirent_scan(struct dirent_scan **root_inout, struct dirent_scan *n
 (ignore)addnode(root_inout,node,cmp);
 }
 
+struct key_dirent_scan {
+	uint64_t prefix; // first 8 bytes of the name, big-endian, most compares end here
+	struct dirent_scan *node;
+};
+
+static int cmpkey(const void *a_in, const void *b_in) {
+const struct key_dirent_scan *a=a_in,*b=b_in;
+if (a->prefix!=b->prefix) return (a->prefix<b->prefix)?-1:1;
+return strcmp(a->node->filename,b->node->filename);
+}
+
+static int buildtree(struct dirent_scan **root_out, struct key_dirent_scan *keys, unsigned int count) {
+// returns the height, the middle of keys is the root
+struct dirent_scan *root;
+unsigned int mid;
+int left,right;
+if (!count) {
+	*root_out=NULL;
+	return 0;
+}
+mid=count/2;
+root=keys[mid].node;
+left=buildtree(&LEFT(root),keys,mid);
+right=buildtree(&RIGHT(root),keys+mid+1,count-mid-1);
+BALANCE(root)=left-right; // left has the extra node, if there is one
+*root_out=root;
+return 1+left;
+}
+
+int fromlist_sort_dirent_scan(struct dirent_scan **root_inout, struct dirent_scan *list) {
+/* sorts the .next-linked list once and builds a balanced tree from it, cheaper than adding one at a time */
+struct key_dirent_scan *keys=NULL;
+struct dirent_scan *node;
+unsigned int count=0,ui;
+
+if (*root_inout) { // not expected, but keep what's already there
+	while (list) {
+		node=list;
+		list=list->next;
+		node->next=NULL;
+		(ignore)addnode(root_inout,node,cmp);
+	}
+	return 0;
+}
+for (node=list;node;node=node->next) count+=1;
+if (!count) return 0;
+if (!(keys=malloc(count*sizeof(struct key_dirent_scan)))) GOTOERROR;
+for (node=list,ui=0;node;node=node->next,ui++) {
+	unsigned char *name=(unsigned char *)node->filename;
+	uint64_t prefix=0;
+	unsigned int i;
+	for (i=0;i<8;i++) {
+		prefix<<=8;
+		if (*name) prefix|=*name++;
+	}
+	keys[ui].prefix=prefix;
+	keys[ui].node=node;
+}
+qsort(keys,count,sizeof(struct key_dirent_scan),cmpkey);
+for (ui=0;ui<count;ui++) keys[ui].node->next=NULL;
+(ignore)buildtree(root_inout,keys,count);
+free(keys);
+return 0;
+error:
+	return -1;
+}
+
 struct dirent_scan *find_dirent_scan(struct dirent_scan *root, char *name) {
 while (root) {
 	int r;
-	r=strcmp(root->filename,name);
+	r=strcmp(name,root->filename);
 	if (r<0) root=LEFT(root);
 	else if (!r) return root;
 	else root=RIGHT(root);
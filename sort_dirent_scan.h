@@ -19,3 +19,4 @@
  */
 void add_sort_dirent_scan(struct dirent_scan **root_inout, struct dirent_scan *node);
 struct dirent_scan *find_dirent_scan(struct dirent_scan *root, char *name);
+int fromlist_sort_dirent_scan(struct dirent_scan **root_inout, struct dirent_scan *list);
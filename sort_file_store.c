@@ -1,5 +1,5 @@
 /*
- * sort_inode_scan.c - btree sort for inodes in scan
+ * sort_file_store.c - btree sort for files in store
  * Copyright (C) 2021 Sanjay Rao
  *
  * This program is free software; you can redistribute it and/or modify
@@ -21,24 +21,27 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <zlib.h>
 #include "common/conventions.h"
 #include "common/mapmem.h"
 #include "options.h"
 #include "scan.h"
+#include "compress.h"
+#include "store.h"
 
-#include "sort_inode_scan.h"
+#include "sort_file_store.h"
 
 #define LEFT(a)	(a)->treevars.left
 #define RIGHT(a)	(a)->treevars.right
 #define BALANCE(a)	(a)->treevars.balance
 
-static inline int cmp(struct inode_scan *a, struct inode_scan *b) {
+static inline int cmp(struct file_store *a, struct file_store *b) {
 if (a->devnumber==b->devnumber) return _FASTCMP(a->number,b->number);
 return _FASTCMP(a->devnumber,b->devnumber);
 }
 
-struct inode_scan *find_sort_inode_scan(struct inode_scan *root, uint64_t ino, dev_t devnumber) {
-struct inode_scan match;
+struct file_store *find_sort_file_store(struct file_store *root, uint64_t ino, dev_t devnumber) {
+struct file_store match;
 match.number=ino;
 match.devnumber=devnumber;
 while (root) {
@@ -51,9 +54,9 @@ while (root) {
 return NULL;
 }
 
-static inline void rebalanceleftleft(struct inode_scan **root_inout) {
-struct inode_scan *a=*root_inout;
-struct inode_scan *left=LEFT(a);
+static inline void rebalanceleftleft(struct file_store **root_inout) {
+struct file_store *a=*root_inout;
+struct file_store *left=LEFT(a);
 LEFT(a)=RIGHT(left);
 RIGHT(left)=a;
 *root_inout=left;
@@ -61,9 +64,9 @@ BALANCE(left)=0;
 BALANCE(a)=0;
 }
 
-static inline void rebalancerightright(struct inode_scan **root_inout) {
-struct inode_scan *a=*root_inout;
-struct inode_scan *right=RIGHT(a);
+static inline void rebalancerightright(struct file_store **root_inout) {
+struct file_store *a=*root_inout;
+struct file_store *right=RIGHT(a);
 RIGHT(a)=LEFT(right);
 LEFT(right)=a;
 *root_inout=right;
@@ -71,10 +74,10 @@ BALANCE(right)=0;
 BALANCE(a)=0;
 }
 
-static inline void rebalanceleftright(struct inode_scan **root_inout) {
-struct inode_scan *a=*root_inout;
-struct inode_scan *left=LEFT(a);
-struct inode_scan *gchild=RIGHT(left);
+static inline void rebalanceleftright(struct file_store **root_inout) {
+struct file_store *a=*root_inout;
+struct file_store *left=LEFT(a);
+struct file_store *gchild=RIGHT(left);
 int b;
 RIGHT(left)=LEFT(gchild);
 LEFT(gchild)=left;
@@ -94,10 +97,10 @@ if (b>0) {
 BALANCE(gchild)=0;
 }
 
-static inline void rebalancerightleft(struct inode_scan **root_inout) {
-struct inode_scan *a=*root_inout;
-struct inode_scan *right=RIGHT(a);
-struct inode_scan *gchild=LEFT(right);
+static inline void rebalancerightleft(struct file_store **root_inout) {
+struct file_store *a=*root_inout;
+struct file_store *right=RIGHT(a);
+struct file_store *gchild=LEFT(right);
 int b;
 LEFT(right)=RIGHT(gchild);
 RIGHT(gchild)=right;
@@ -117,9 +120,9 @@ if (b<0) {
 BALANCE(gchild)=0;
 }
 
-static int addnode(struct inode_scan **root_inout, struct inode_scan *node, int (*cmp)(struct inode_scan*,struct inode_scan*)) {
+static int addnode(struct file_store **root_inout, struct file_store *node, int (*cmp)(struct file_store*,struct file_store*)) {
 /* returns 1 if depth increased, else 0 */
-struct inode_scan *root=*root_inout;
+struct file_store *root=*root_inout;
 int r=0;
 
 if (!root) {
@@ -156,7 +159,7 @@ if (cmp((node),(root))<0) {
 return r;
 }
 
-void add_sort_inode_scan(struct inode_scan **root_inout, struct inode_scan *node) {
+void add_sort_file_store(struct file_store **root_inout, struct file_store *node) {
 /* node should be 0'd out already (except for data) */
 (ignore)addnode(root_inout,node,cmp);
 }
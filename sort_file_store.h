@@ -1,6 +1,6 @@
 
 /*
- * sort_inode_scan.h
+ * sort_file_store.h
  * Copyright (C) 2021 Sanjay Rao
  *
  * This program is free software; you can redistribute it and/or modify
@@ -17,5 +17,5 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
-void add_sort_inode_scan(struct inode_scan **root_inout, struct inode_scan *node);
-struct inode_scan *find_sort_inode_scan(struct inode_scan *root, uint64_t ino, dev_t devnumber);
+void add_sort_file_store(struct file_store **root_inout, struct file_store *node);
+struct file_store *find_sort_file_store(struct file_store *root, uint64_t ino, dev_t devnumber);
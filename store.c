@@ -0,0 +1,612 @@
+/*
+ * store.c - compressed file data, kept between builds
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "common/conventions.h"
+#include "common/mapmem.h"
+#include "common/fileio.h"
+#include "options.h"
+#include "scan.h"
+#include "sort_file_store.h"
+
+#include "compress.h"
+#include "store.h"
+
+#define MAXTHREADS_STORE	64
+#define QUEUESIZE_STORE	128
+#define MAXENTROPY_STORE	7.5 // bits per byte, above this the first block looks like compressed media
+
+#define NUM_FOOTER_STORE	48
+#define MAGIC_FOOTER_STORE	"psqfsz2\n"
+// cache file, named by inode, compressor and block size: [compressed image: .datasize bytes][.blockcount le32 block sizes][footer]
+// footer: magic[8] size:u64 mtime:u32 blocksize:u32 compressor:u32 blockcount:u32 datasize:u64 israw:u32 mtimensec:u32
+// compressor is the gzip level for gzip, (id<<16)|level otherwise
+
+// extensions of files that are already compressed
+static char *skipextensions[]={
+	"7z","aac","apk","avi","bz2","deb","flac","gif","gz","heic","jar","jpeg","jpg","lz","lz4","lzma","m4a","m4v","mkv",
+	"mov","mp3","mp4","mpeg","mpg","ogg","opus","png","rar","rpm","sqfs","squashfs","tbz2","tgz","txz","webm","webp",
+	"wma","wmv","xz","zip","zst",
+	NULL};
+
+struct job_store {
+	int fd;
+	struct file_store *file;
+};
+
+struct queue_store {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct job_store jobs[QUEUESIZE_STORE];
+	unsigned int first,count;
+	int isdone; // no more jobs are coming
+	struct store *store;
+};
+
+struct worker_store {
+	pthread_t thread;
+	struct queue_store *queue;
+	struct compress compressor;
+	unsigned char *inbuffer,*outbuffer;
+	unsigned int compressed,raw; // stats, added to store after join
+	uint64_t bytessaved;
+};
+
+#define setu32(a,b) *(uint32_t*)(a)=htole32(b)
+#define setu64(a,b) *(uint64_t*)(a)=htole64(b)
+#define getu32(a) le32toh(*(uint32_t*)(a))
+#define getu64(a) le64toh(*(uint64_t*)(a))
+
+static void clearfile(struct file_store *f) {
+// drop the data, keep the node in the tree
+iffree(f->blocksizes);
+iffree(f->data);
+iffree(f->cachefile);
+f->blocksizes=NULL;
+f->data=NULL;
+f->cachefile=NULL;
+f->isready=0;
+f->israw=0;
+f->blockcount=0;
+f->datasize=0;
+}
+
+static void freetree(struct file_store *f) {
+if (!f) return;
+freetree(f->treevars.left);
+freetree(f->treevars.right);
+(void)clearfile(f);
+free(f);
+}
+
+static void cleartree(struct file_store *f) {
+if (!f) return;
+cleartree(f->treevars.left);
+cleartree(f->treevars.right);
+(void)clearfile(f);
+}
+
+static uint32_t compressortag(struct config_compress *c) {
+if (c->id==GZIP_ID_COMPRESS) return c->level;
+return (c->id<<16)|c->level;
+}
+
+void setconfig_store(struct store *store, struct config_compress *compress, unsigned int blocksize, unsigned int minsize,
+		unsigned int threads, char *directory) {
+if ((store->config.compress.id!=compress->id) || (store->config.compress.level!=compress->level)
+		|| (store->config.blocksize!=blocksize)) {
+	(void)cleartree(store->top); // nothing we have is reusable
+}
+store->config.compress=*compress;
+store->config.blocksize=blocksize;
+store->config.minsize=minsize;
+store->config.threads=threads;
+store->config.directory=directory;
+}
+
+void deinit_store(struct store *store) {
+(void)freetree(store->top);
+}
+
+static void sweep(struct store *store, struct file_store *f) {
+if (!f) return;
+sweep(store,f->treevars.left);
+sweep(store,f->treevars.right);
+if (f->generation!=store->generation) (void)clearfile(f);
+}
+
+void sweep_store(struct store *store) {
+// release files that weren't in the last build
+(void)sweep(store,store->top);
+}
+
+static int isskipextension(char *filename) {
+char **ext;
+char *dot;
+if (!(dot=strrchr(filename,'.'))) return 0;
+dot++;
+for (ext=skipextensions;*ext;ext++) {
+	if (!strcasecmp(dot,*ext)) return 1;
+}
+return 0;
+}
+
+static int ishighentropy(unsigned char *data, unsigned int len) {
+unsigned int counts[256];
+double e=0.0;
+unsigned int ui;
+if (len<4096) return 0; // too little to tell, compression will decide
+memset(counts,0,sizeof(counts));
+for (ui=0;ui<len;ui++) counts[data[ui]]+=1;
+for (ui=0;ui<256;ui++) {
+	double p;
+	if (!counts[ui]) continue;
+	p=(double)counts[ui]/len;
+	e-=p*log2(p);
+}
+return e>MAXENTROPY_STORE;
+}
+
+static int iszero(unsigned char *data, unsigned int len) {
+if (!len) return 1;
+if (*data) return 0;
+return !memcmp(data,data+1,len-1);
+}
+
+static char *cachefilename(struct store *store, struct file_store *f, char *suffix) {
+char *name;
+unsigned int len;
+len=strlen(store->config.directory)+1+16+1+16+1+8+1+8+strlen(suffix)+1;
+if (!(name=malloc(len))) return NULL;
+// exports can share a directory, each configuration gets its own files
+snprintf(name,len,"%s/%016"PRIx64"-%016"PRIx64"-%08x-%08x%s",store->config.directory,(uint64_t)f->devnumber,f->number,
+		compressortag(&store->config.compress),store->config.blocksize,suffix);
+return name;
+}
+
+static int loadcache(struct store *store, struct file_store *f) {
+// returns 0 if f was filled from the cache directory, 1 if it needs to be compressed
+unsigned char footer[NUM_FOOTER_STORE];
+struct stat st;
+uint64_t datasize;
+unsigned int blockcount,ui;
+int fd=-1;
+char *name=NULL;
+
+if (!(name=cachefilename(store,f,""))) GOTOERROR;
+if (0>(fd=open(name,O_RDONLY))) goto miss;
+if (fstat(fd,&st)) goto miss;
+if (st.st_size<NUM_FOOTER_STORE) goto miss;
+if (preadn(fd,footer,NUM_FOOTER_STORE,st.st_size-NUM_FOOTER_STORE,NULL)) goto miss;
+if (memcmp(footer,MAGIC_FOOTER_STORE,8)) goto miss;
+if (getu64(footer+8)!=f->size) goto miss;
+if (getu32(footer+16)!=f->mtime) goto miss;
+if (getu32(footer+44)!=f->mtimensec) goto miss;
+if (getu32(footer+20)!=store->config.blocksize) goto miss;
+if (getu32(footer+24)!=compressortag(&store->config.compress)) goto miss;
+blockcount=getu32(footer+28);
+datasize=getu64(footer+32);
+if (getu32(footer+40)) { // compressing it didn't help last time
+	iffree(name);
+	ignore_ifclose(fd);
+	f->israw=1;
+	f->isready=1;
+	return 0;
+}
+if (blockcount!=(f->size+store->config.blocksize-1)/store->config.blocksize) goto miss;
+if ((uint64_t)st.st_size!=datasize+(uint64_t)blockcount*4+NUM_FOOTER_STORE) goto miss;
+if (!(f->blocksizes=malloc(blockcount*sizeof(uint32_t)))) GOTOERROR;
+if (preadn(fd,(unsigned char *)f->blocksizes,blockcount*sizeof(uint32_t),datasize,NULL)) goto miss;
+{
+	uint64_t sum=0;
+	for (ui=0;ui<blockcount;ui++) {
+		f->blocksizes[ui]=le32toh(f->blocksizes[ui]);
+		sum+=f->blocksizes[ui]&(UNCOMPRESSED_BIT_STORE-1);
+	}
+	if (sum!=datasize) goto miss;
+}
+(ignore)close(fd);
+f->blockcount=blockcount;
+f->datasize=datasize;
+f->cachefile=name;
+f->isready=1;
+return 0;
+miss:
+	iffree(f->blocksizes);
+	f->blocksizes=NULL;
+	iffree(name);
+	ignore_ifclose(fd);
+	return 1;
+error:
+	iffree(name);
+	ignore_ifclose(fd);
+	return -1;
+}
+
+static int appendout(struct file_store *f, uint64_t *max_inout, int fd, unsigned char *data, unsigned int len) {
+// appends to the cache file if fd>=0, else to f->data
+if (fd>=0) {
+	if (writen(fd,data,len)) GOTOERROR;
+} else {
+	if (f->datasize+len > *max_inout) {
+		unsigned char *temp;
+		uint64_t max;
+		max=*max_inout*2;
+		if (max<f->datasize+len) max=f->datasize+len;
+		if (!(temp=realloc(f->data,max))) GOTOERROR;
+		f->data=temp;
+		*max_inout=max;
+	}
+	memcpy(f->data+f->datasize,data,len);
+}
+f->datasize+=len;
+return 0;
+error:
+	return -1;
+}
+
+static int compressfile(struct worker_store *w, struct store *store, int fd, struct file_store *f) {
+// returns 0 if compressed, 1 if it should be used raw
+const unsigned int blocksize=store->config.blocksize;
+uint64_t offset=0,max=0;
+unsigned int ui,compressedcount=0;
+char *name=NULL,*tempname=NULL;
+int cfd=-1;
+
+f->blockcount=(f->size+blocksize-1)/blocksize;
+f->datasize=0;
+if (!store->config.directory) {
+	if (f->size>UINT32_MAX) goto raw; // range keeps in-memory data with 32bit lengths
+	max=f->size/2;
+	if (max<blocksize) max=blocksize;
+	if (!(f->data=malloc(max))) GOTOERROR;
+}
+if (!(f->blocksizes=malloc(f->blockcount*sizeof(uint32_t)))) GOTOERROR;
+if (store->config.directory) {
+	char suffix[32];
+	snprintf(suffix,32,".tmp%u",(unsigned int)syscall(SYS_gettid)); // exports can share a cache and build at the same time
+	if (!(name=cachefilename(store,f,""))) GOTOERROR;
+	if (!(tempname=cachefilename(store,f,suffix))) GOTOERROR;
+	if (0>(cfd=open(tempname,O_WRONLY|O_CREAT|O_TRUNC,0600))) {
+		syslog(LOG_ERR,"Error creating cache file %s %s",tempname,strerror(errno));
+		GOTOERROR;
+	}
+}
+
+for (ui=0;ui<f->blockcount;ui++) {
+	unsigned int k,csize;
+	k=blocksize;
+	if (f->size-offset<k) k=f->size-offset;
+	if (preadn(fd,w->inbuffer,k,offset,NULL)) goto raw; // file changed under us, it'll be a read error later
+	if (!ui && ishighentropy(w->inbuffer,k)) goto raw;
+	if (iszero(w->inbuffer,k)) { // a sparse block, it takes no space
+		f->blocksizes[ui]=0;
+		w->bytessaved+=k;
+		compressedcount+=1;
+		offset+=k;
+		continue;
+	}
+
+	if (block_compress(&csize,&w->compressor,w->outbuffer,k-1,w->inbuffer,k)) GOTOERROR; // we only want it if it's smaller
+	if (csize) {
+		if (appendout(f,&max,cfd,w->outbuffer,csize)) GOTOERROR;
+		f->blocksizes[ui]=csize;
+		w->bytessaved+=k-csize;
+		compressedcount+=1;
+	} else {
+		if (appendout(f,&max,cfd,w->inbuffer,k)) GOTOERROR;
+		f->blocksizes[ui]=k|UNCOMPRESSED_BIT_STORE;
+	}
+	offset+=k;
+}
+if (!compressedcount) goto raw;
+
+if (cfd>=0) {
+	unsigned char footer[NUM_FOOTER_STORE];
+	for (ui=0;ui<f->blockcount;ui++) {
+		unsigned char buff4[4];
+		setu32(buff4,f->blocksizes[ui]);
+		if (writen(cfd,buff4,4)) GOTOERROR;
+	}
+	memset(footer,0,NUM_FOOTER_STORE);
+	memcpy(footer,MAGIC_FOOTER_STORE,8);
+	setu64(footer+8,f->size);
+	setu32(footer+16,f->mtime);
+	setu32(footer+20,blocksize);
+	setu32(footer+24,compressortag(&store->config.compress));
+	setu32(footer+28,f->blockcount);
+	setu64(footer+32,f->datasize);
+	setu32(footer+44,f->mtimensec);
+	if (writen(cfd,footer,NUM_FOOTER_STORE)) GOTOERROR;
+	if (close(cfd)) { cfd=-1; GOTOERROR; }
+	cfd=-1;
+	if (rename(tempname,name)) GOTOERROR;
+	free(tempname);
+	f->cachefile=name;
+} else if (!f->datasize) { // all sparse blocks, realloc(,0) would free it behind our back
+	free(f->data);
+	f->data=NULL;
+} else {
+	unsigned char *temp;
+	if ((temp=realloc(f->data,f->datasize))) f->data=temp;
+}
+f->isready=1;
+return 0;
+raw:
+	(void)clearfile(f);
+	if (cfd>=0) { // leave a footer so we don't try again next time
+		unsigned char footer[NUM_FOOTER_STORE];
+		memset(footer,0,NUM_FOOTER_STORE);
+		memcpy(footer,MAGIC_FOOTER_STORE,8);
+		setu64(footer+8,f->size);
+		setu32(footer+16,f->mtime);
+		setu32(footer+20,blocksize);
+		setu32(footer+24,compressortag(&store->config.compress));
+		setu32(footer+40,1);
+		setu32(footer+44,f->mtimensec);
+		if (ftruncate(cfd,0) || (NUM_FOOTER_STORE!=pwrite(cfd,footer,NUM_FOOTER_STORE,0)) || close(cfd) || rename(tempname,name)) {
+			(ignore)unlink(tempname);
+		}
+		cfd=-1;
+	}
+	iffree(name);
+	iffree(tempname);
+	f->israw=1;
+	f->isready=1;
+	return 1;
+error:
+	if (cfd>=0) {
+		(ignore)close(cfd);
+		(ignore)unlink(tempname);
+	}
+	iffree(name);
+	iffree(tempname);
+	(void)clearfile(f);
+	return -1;
+}
+
+static void *worker_thread(void *arg) {
+struct worker_store *w=(struct worker_store*)arg;
+struct queue_store *q=w->queue;
+(ignore)pthread_mutex_lock(&q->mutex);
+while (1) {
+	struct job_store job;
+	int r;
+	if (!q->count) {
+		if (q->isdone) break;
+		(ignore)pthread_cond_wait(&q->cond,&q->mutex);
+		continue;
+	}
+	job=q->jobs[q->first];
+	q->first=(q->first+1)%QUEUESIZE_STORE;
+	q->count-=1;
+	(ignore)pthread_cond_broadcast(&q->cond);
+	(ignore)pthread_mutex_unlock(&q->mutex);
+	r=compressfile(w,q->store,job.fd,job.file);
+	(ignore)close(job.fd);
+	if (r<0) { // not fatal, the file is served uncompressed
+		job.file->israw=1;
+		job.file->isready=1;
+	}
+	if (r) w->raw+=1;
+	else w->compressed+=1;
+	(ignore)pthread_mutex_lock(&q->mutex);
+}
+(ignore)pthread_mutex_unlock(&q->mutex);
+return NULL;
+}
+
+static int addjob(struct queue_store *q, int fd, struct file_store *f) {
+(ignore)pthread_mutex_lock(&q->mutex);
+while (q->count==QUEUESIZE_STORE) (ignore)pthread_cond_wait(&q->cond,&q->mutex);
+q->jobs[(q->first+q->count)%QUEUESIZE_STORE].fd=fd;
+q->jobs[(q->first+q->count)%QUEUESIZE_STORE].file=f;
+q->count+=1;
+(ignore)pthread_cond_broadcast(&q->cond);
+(ignore)pthread_mutex_unlock(&q->mutex);
+return 0;
+}
+
+struct walk_store {
+	struct store *store;
+	struct queue_store *queue;
+	struct options *options;
+};
+
+static int addfile(struct walk_store *walk, int dirfd, struct dirent_scan *de) {
+struct store *store=walk->store;
+struct file_scan *fs=de->file;
+struct file_store *f;
+int fd;
+
+if (!fs->size) return 0;
+if (fs->size<store->config.minsize) return 0;
+if (fs->store) return 0; // a hardlink we've seen
+if (fs->dupof) return 0; // its twin is compressed
+if (!(f=find_sort_file_store(store->top,fs->common.inode->number,fs->common.inode->devnumber))) {
+	if (!(f=ZTMALLOC(1,struct file_store))) GOTOERROR;
+	f->number=fs->common.inode->number;
+	f->devnumber=fs->common.inode->devnumber;
+	(void)add_sort_file_store(&store->top,f);
+}
+f->generation=store->generation;
+fs->store=f;
+if (f->isready) {
+	if ((f->size==fs->size) && (f->mtime==fs->common.mtime) && (f->mtimensec==fs->mtimensec)) {
+		if (f->israw) store->stats.raw+=1;
+		else { store->stats.reused+=1; store->stats.bytessaved+=f->size-f->datasize; }
+		return 0;
+	}
+	(void)clearfile(f);
+}
+f->size=fs->size;
+f->mtime=fs->common.mtime;
+f->mtimensec=fs->mtimensec;
+if (isskipextension(de->filename)) {
+	f->israw=1;
+	f->isready=1;
+	store->stats.raw+=1;
+	return 0;
+}
+if (store->config.directory) {
+	switch (loadcache(store,f)) {
+		case 0:
+			if (f->israw) store->stats.raw+=1;
+			else { store->stats.reused+=1; store->stats.bytessaved+=f->size-f->datasize; }
+			return 0;
+		case 1: break;
+		default: GOTOERROR;
+	}
+}
+if (de->overlay) fd=open(de->overlay,O_RDONLY);
+else if (dirfd>=0) fd=openat(dirfd,de->filename,O_RDONLY);
+else fd=-1;
+if (fd<0) { // range will report this if a client asks for it
+	if (walk->options->isverbose) syslog(LOG_INFO,"Not compressing %s, couldn't open it",de->filename);
+	fs->store=NULL;
+	return 0;
+}
+if (addjob(walk->queue,fd,f)) { (ignore)close(fd); GOTOERROR; }
+return 0;
+error:
+	return -1;
+}
+
+static int walkdir(struct walk_store *walk, int dirfd, struct dirent_scan *de) {
+if (!de) return 0;
+if (walkdir(walk,dirfd,de->treevars.left)) GOTOERROR;
+switch (de->type) {
+	case FILE_TYPE_SCAN:
+		if (addfile(walk,dirfd,de)) GOTOERROR;
+		break;
+	case DIRECTORY_TYPE_SCAN:
+		{
+			int fd;
+			if (de->overlay) fd=open(de->overlay,O_RDONLY|O_DIRECTORY);
+			else if (dirfd>=0) fd=openat(dirfd,de->filename,O_RDONLY|O_DIRECTORY);
+			else fd=-1; // made up directories only have overlays
+			if (walkdir(walk,fd,de->directory->entries.top)) { ignore_ifclose(fd); GOTOERROR; }
+			ignore_ifclose(fd);
+		}
+		break;
+}
+if (walkdir(walk,dirfd,de->treevars.right)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static void deinit_worker(struct worker_store *w) {
+(void)deinit_compress(&w->compressor);
+iffree(w->inbuffer);
+iffree(w->outbuffer);
+}
+
+static int init_worker(struct worker_store *w, struct queue_store *q) {
+w->queue=q;
+if (!(w->inbuffer=malloc(q->store->config.blocksize))) GOTOERROR;
+if (!(w->outbuffer=malloc(q->store->config.blocksize))) GOTOERROR;
+if (init_compress(&w->compressor,&q->store->config.compress)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+int compress_store(struct store *store, struct scan *scan, struct options *options) {
+// sets file_scan.store for every file with data, those with .israw should be used as-is
+struct queue_store queue;
+struct worker_store *workers=NULL;
+struct walk_store walk;
+unsigned int numthreads,started=0,ui;
+int rootfd=-1,iserror=0;
+
+store->generation+=1;
+memset(&store->stats,0,sizeof(store->stats));
+
+numthreads=store->config.threads;
+if (!numthreads) {
+	long l;
+	l=sysconf(_SC_NPROCESSORS_ONLN);
+	numthreads=(l>0)?(unsigned int)l:1;
+}
+if (numthreads>MAXTHREADS_STORE) numthreads=MAXTHREADS_STORE;
+
+memset(&queue,0,sizeof(queue));
+queue.store=store;
+if (pthread_mutex_init(&queue.mutex,NULL)) GOTOERROR;
+if (pthread_cond_init(&queue.cond,NULL)) { (ignore)pthread_mutex_destroy(&queue.mutex); GOTOERROR; }
+
+if (!(workers=ZTMALLOC(numthreads,struct worker_store))) goto stop;
+for (ui=0;ui<numthreads;ui++) {
+	if (init_worker(&workers[ui],&queue)) goto stop;
+	if (pthread_create(&workers[ui].thread,NULL,worker_thread,&workers[ui])) goto stop;
+	started+=1;
+}
+
+walk.store=store;
+walk.queue=&queue;
+walk.options=options;
+if (*scan->rootdir.path) {
+	if (0>(rootfd=open(scan->rootdir.path,O_RDONLY|O_DIRECTORY))) goto stop;
+}
+if (walkdir(&walk,rootfd,scan->rootdir.directory.entries.top)) goto stop;
+goto done;
+stop:
+	WHEREAMI;
+	iserror=1;
+done:
+	ignore_ifclose(rootfd);
+	(ignore)pthread_mutex_lock(&queue.mutex);
+	queue.isdone=1;
+	(ignore)pthread_cond_broadcast(&queue.cond);
+	(ignore)pthread_mutex_unlock(&queue.mutex);
+	for (ui=0;ui<started;ui++) {
+		(ignore)pthread_join(workers[ui].thread,NULL);
+		store->stats.compressed+=workers[ui].compressed;
+		store->stats.raw+=workers[ui].raw;
+		store->stats.bytessaved+=workers[ui].bytessaved;
+	}
+	if (workers) {
+		for (ui=0;ui<numthreads;ui++) (void)deinit_worker(&workers[ui]);
+		free(workers);
+	}
+	(ignore)pthread_cond_destroy(&queue.cond);
+	(ignore)pthread_mutex_destroy(&queue.mutex);
+if (iserror) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
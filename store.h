@@ -0,0 +1,62 @@
+/*
+ * store.h
+ * Copyright (C) 2021 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define UNCOMPRESSED_BIT_STORE	(1<<24)
+
+struct file_store { // compressed image of one file, kept between builds
+	uint64_t number; // actual inode
+	dev_t devnumber;
+	uint64_t size; // of underlying data, with .mtime this tells us if the file changed
+	uint32_t mtime,mtimensec;
+
+	unsigned int generation; // last build that used this
+	int isready:1; // .israw or the data below is valid
+	int israw:1; // not worth compressing, range should use the file as-is
+	unsigned int blockcount;
+	uint32_t *blocksizes; // as written in the inode: compressed size or (size|UNCOMPRESSED_BIT_STORE)
+	uint64_t datasize; // sum of .blocksizes, this is the size in the archive
+	unsigned char *data; // in memory, if there's no cache directory
+	char *cachefile; // on disk, in the cache directory
+
+	struct {
+		signed char balance;
+		struct file_store *left,*right;
+	} treevars;
+};
+
+struct store {
+	struct {
+		struct config_compress compress;
+		unsigned int blocksize;
+		unsigned int threads; // 0 => one per cpu
+		unsigned int minsize; // smaller files are left alone, e.g., for fragments
+		char *directory; // NULL => keep compressed data in memory
+	} config;
+	unsigned int generation;
+	struct file_store *top;
+	struct {
+		unsigned int compressed,raw,reused;
+		uint64_t bytessaved;
+	} stats; // for the last build
+};
+
+void setconfig_store(struct store *store, struct config_compress *compress, unsigned int blocksize, unsigned int minsize,
+		unsigned int threads, char *directory);
+void deinit_store(struct store *store);
+int compress_store(struct store *store, struct scan *scan, struct options *options);
+void sweep_store(struct store *store);